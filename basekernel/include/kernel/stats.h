@@ -4,10 +4,23 @@
 #include "kernel/types.h"
 #include "kernel/syscall.h"
 
+/*
+Scheduler latency, from wakeup to running, is kept as a histogram:
+bucket 0 counts latencies under 32us, bucket k counts latencies in
+[2^(k+4), 2^(k+5)) us, and the last bucket counts everything longer.
+*/
+
+#define SCHED_LATENCY_BUCKETS 16
+
 struct system_stats {
 	int time;
 	int blocks_read[4];
 	int blocks_written[4];
+	int sched_quantum;
+	int sched_ticks_per_second;
+	int sched_switches;
+	int sched_preemptions;
+	int sched_latency[SCHED_LATENCY_BUCKETS];
 };
 
 struct device_driver_stats {
@@ -21,13 +34,49 @@ struct bcache_stats {
 	int write_hits;
 	int write_misses;
 	int writebacks;
+	int evictions;
+	int size;
+	int limit;
+	int high_watermark;
+	int readahead_hits;	// reads of blocks brought in by read-ahead
+	int readahead_misses;	// blocks read ahead but evicted unread
+};
+
+#define KMALLOC_STATS_CLASSES 16
+
+struct kmalloc_stats {
+	int bytes_total;
+	int bytes_in_use;
+	int largest_free;
+	int class_free[KMALLOC_STATS_CLASSES];
+	int class_used[KMALLOC_STATS_CLASSES];
 };
 
+/*
+Ticks are scheduler ticks, charged to the process running when
+the clock ticks: to system time if it was in the kernel then.
+A major fault reads a page of the program from its file, a minor
+fault only clears or copies a page.  Resident pages are those
+mapped in the address space, shared ones included, and are the
+same for all threads of a process.
+*/
+
 struct process_stats {
+	int user_ticks;
+	int system_ticks;
+	int voluntary_switches;
+	int involuntary_switches;
+	int minor_faults;
+	int major_faults;
+	int resident_pages;
+	int peak_resident_pages;
 	int blocks_read;
 	int blocks_written;
 	int bytes_read;
 	int bytes_written;
+	int pages_copied;
+	int tlb_flushes;
+	int tlb_page_flushes;
 	int syscall_count[MAX_SYSCALL];
 };
 
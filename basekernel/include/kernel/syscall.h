@@ -26,6 +26,10 @@ typedef enum {
 	SYSCALL_PROCESS_SLEEP,
 	SYSCALL_PROCESS_STATS,
 	SYSCALL_PROCESS_HEAP,
+	SYSCALL_PROCESS_SET_PRIORITY,
+	SYSCALL_PROCESS_LIST,
+	SYSCALL_THREAD_CREATE,
+	SYSCALL_THREAD_JOIN,
 	SYSCALL_OPEN_FILE,
 	SYSCALL_OPEN_DIR,
 	SYSCALL_OPEN_WINDOW,
@@ -47,8 +51,11 @@ typedef enum {
 	SYSCALL_SYSTEM_STATS,
 	SYSCALL_BCACHE_STATS,
 	SYSCALL_BCACHE_FLUSH,
+	SYSCALL_BCACHE_SET_SIZE,
+	SYSCALL_KMALLOC_STATS,
 	SYSCALL_SYSTEM_TIME,
 	SYSCALL_SYSTEM_RTC,
+	SYSCALL_SYSTEM_CLOCK,
 	SYSCALL_DEVICE_DRIVER_STATS,
 	MAX_SYSCALL		// must be the last element in the enum
 } syscall_t;
@@ -27,8 +27,15 @@ int syscall_process_reap(unsigned int pid);
 int syscall_process_wait(struct process_info *info, int timeout);
 int syscall_process_sleep(unsigned int ms);
 int syscall_process_stats(struct process_stats *s, unsigned int pid);
+int syscall_process_set_priority(unsigned int pid, int priority);
+int syscall_process_list(int *pids, int max);
 extern void *syscall_process_heap(int a);
 
+/* Syscalls that manage threads sharing the address space and objects of this process. */
+
+int syscall_thread_create(void (*entry) (void *), void *arg, void *stack, int stack_size);
+int syscall_thread_join(unsigned int tid, struct process_info *info);
+
 /* Syscalls that open or create new kernel objects for this process. */
 
 int syscall_open_file(int fd, const char *path, int mode, kernel_flags_t flags);
@@ -58,9 +65,12 @@ int syscall_system_stats(struct system_stats *s);
 int syscall_bcache_stats(struct bcache_stats *s);
 
 int syscall_bcache_flush();
+int syscall_bcache_set_size(int blocks);
+int syscall_kmalloc_stats(struct kmalloc_stats *s);
 
 int syscall_system_time( uint32_t *t );
 int syscall_system_rtc( struct rtc_time *t );
+int syscall_system_clock( uint32_t *ms );
 
 int syscall_device_driver_stats(char * name, struct device_driver_stats * stats);
 
@@ -0,0 +1,170 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "apic.h"
+#include "clock.h"
+#include "console.h"
+
+/*
+The local APIC is a set of 32-bit registers, 16 bytes apart,
+mapped into physical memory at the address given by the MP table.
+The kernel maps that region uncached into every address space.
+*/
+
+#define APIC_ID            0x020
+#define APIC_TPR           0x080
+#define APIC_EOI           0x0b0
+#define APIC_SVR           0x0f0
+#define APIC_ESR           0x280
+#define APIC_ICR_LOW       0x300
+#define APIC_ICR_HIGH      0x310
+#define APIC_LVT_TIMER     0x320
+#define APIC_LVT_LINT0     0x350
+#define APIC_LVT_LINT1     0x360
+#define APIC_LVT_ERROR     0x370
+#define APIC_TIMER_INITIAL 0x380
+#define APIC_TIMER_CURRENT 0x390
+#define APIC_TIMER_DIVIDE  0x3e0
+
+#define APIC_SVR_ENABLE    0x100
+#define APIC_LVT_MASKED    0x10000
+#define APIC_TIMER_PERIODIC 0x20000
+#define APIC_TIMER_DIVIDE_16 0x3
+
+#define APIC_ICR_INIT      0x500
+#define APIC_ICR_STARTUP   0x600
+#define APIC_ICR_PENDING   0x1000
+#define APIC_ICR_ASSERT    0x4000
+#define APIC_ICR_LEVEL     0x8000
+
+static volatile uint32_t *apic = 0;
+
+// Timer counts per second at divide 16, measured once on the boot processor.
+static uint32_t apic_timer_rate = 0;
+
+static uint32_t apic_read(int reg)
+{
+	return apic[reg / 4];
+}
+
+static void apic_write(int reg, uint32_t value)
+{
+	apic[reg / 4] = value;
+	apic_read(APIC_ID);	// wait for the write to finish
+}
+
+static void apic_delay(uint32_t micros)
+{
+	uint32_t start = clock_micros();
+	while(clock_micros() - start < micros) {
+		asm volatile("pause");
+	}
+}
+
+void apic_init(uint32_t address)
+{
+	apic = (volatile uint32_t *) address;
+}
+
+int apic_present()
+{
+	return apic != 0;
+}
+
+/*
+The timer rate is measured against the PIT on the boot processor
+only, since the others must not touch the PIT at the same time.
+*/
+
+static void apic_timer_calibrate()
+{
+	apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+	apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED);
+	apic_write(APIC_TIMER_INITIAL, 0xffffffff);
+	apic_delay(10000);
+	apic_timer_rate = (0xffffffff - apic_read(APIC_TIMER_CURRENT)) * 100;
+	apic_write(APIC_TIMER_INITIAL, 0);
+
+	printf("apic: timer runs at %d KHz\n", apic_timer_rate / 1000);
+}
+
+/*
+Enable the local APIC of the calling processor.  The boot processor
+keeps the LINT0 setting of the BIOS, which passes the interrupts
+of the 8259 PIC through, while the others mask their local lines.
+*/
+
+void apic_cpu_init(int is_boot)
+{
+	apic_write(APIC_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+	if(!is_boot) {
+		apic_write(APIC_LVT_LINT0, APIC_LVT_MASKED);
+		apic_write(APIC_LVT_LINT1, APIC_LVT_MASKED);
+	}
+	apic_write(APIC_LVT_ERROR, APIC_LVT_MASKED);
+	apic_write(APIC_ESR, 0);
+	apic_write(APIC_ESR, 0);
+	apic_write(APIC_TPR, 0);
+	apic_write(APIC_EOI, 0);
+
+	if(is_boot)
+		apic_timer_calibrate();
+}
+
+int apic_id()
+{
+	if(!apic)
+		return 0;
+	return apic_read(APIC_ID) >> 24;
+}
+
+void apic_eoi()
+{
+	if(apic)
+		apic_write(APIC_EOI, 0);
+}
+
+static void apic_send(int apic_id, uint32_t command)
+{
+	apic_write(APIC_ICR_HIGH, apic_id << 24);
+	apic_write(APIC_ICR_LOW, command);
+	while(apic_read(APIC_ICR_LOW) & APIC_ICR_PENDING) {
+		asm volatile("pause");
+	}
+}
+
+void apic_send_ipi(int apic_id, int vector)
+{
+	apic_send(apic_id, APIC_ICR_ASSERT | vector);
+}
+
+/*
+Start another processor with the INIT-SIPI-SIPI sequence.
+It begins in real mode at start_address, which must be a
+page aligned address below 1MB.
+*/
+
+void apic_start_cpu(int apic_id, uint32_t start_address)
+{
+	apic_send(apic_id, APIC_ICR_INIT | APIC_ICR_LEVEL | APIC_ICR_ASSERT);
+	apic_delay(200);
+	apic_send(apic_id, APIC_ICR_INIT | APIC_ICR_LEVEL);
+	apic_delay(10000);
+
+	apic_send(apic_id, APIC_ICR_STARTUP | (start_address >> 12));
+	apic_delay(200);
+	apic_send(apic_id, APIC_ICR_STARTUP | (start_address >> 12));
+	apic_delay(200);
+}
+
+/* Start the calling processor's timer, interrupting frequency times per second. */
+
+void apic_timer_start(int vector, int frequency)
+{
+	apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+	apic_write(APIC_LVT_TIMER, APIC_TIMER_PERIODIC | vector);
+	apic_write(APIC_TIMER_INITIAL, apic_timer_rate / frequency);
+}
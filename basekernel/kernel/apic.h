@@ -0,0 +1,30 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef APIC_H
+#define APIC_H
+
+#include "kernel/types.h"
+
+/*
+Interrupt vectors delivered by the local APIC, above the
+vectors of the PIC (32-47) and the system call (48).
+*/
+
+#define APIC_TIMER_VECTOR      49
+#define APIC_RESCHEDULE_VECTOR 50
+#define APIC_SPURIOUS_VECTOR   63
+
+void apic_init(uint32_t address);
+int  apic_present();
+void apic_cpu_init(int is_boot);
+int  apic_id();
+void apic_eoi();
+void apic_send_ipi(int apic_id, int vector);
+void apic_start_cpu(int apic_id, uint32_t start_address);
+void apic_timer_start(int vector, int frequency);
+
+#endif
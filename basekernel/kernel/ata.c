@@ -55,8 +55,30 @@ See the file LICENSE for details.
 #define ATA_COMMAND_IDLE		0x00
 #define ATA_COMMAND_READ		0x20	/* read data */
 #define ATA_COMMAND_WRITE		0x30	/* write data */
+#define ATA_COMMAND_READ_EXT		0x24	/* read data, 48-bit address */
+#define ATA_COMMAND_WRITE_EXT		0x34	/* write data, 48-bit address */
+#define ATA_COMMAND_READ_MULTIPLE	0xc4	/* read data, several sectors per DRQ */
+#define ATA_COMMAND_WRITE_MULTIPLE	0xc5	/* write data, several sectors per DRQ */
+#define ATA_COMMAND_READ_MULTIPLE_EXT	0x29
+#define ATA_COMMAND_WRITE_MULTIPLE_EXT	0x39
+#define ATA_COMMAND_SET_MULTIPLE	0xc6	/* set sectors per DRQ */
 #define ATA_COMMAND_IDENTIFY		0xec
 
+/*
+Words of the IDENTIFY DEVICE data that tell how to address the drive.
+*/
+
+#define ATA_IDENTIFY_MULTIPLE_MAX	47	/* low byte: most sectors per DRQ */
+#define ATA_IDENTIFY_LBA28_SECTORS	60	/* two words */
+#define ATA_IDENTIFY_FEATURES	83	/* bit 10: 48-bit addresses */
+#define ATA_IDENTIFY_LBA48_SECTORS	100	/* four words */
+
+#define ATA_FEATURE_LBA48	0x0400
+
+/* Most sectors one command can move, where a count of zero means the most. */
+#define ATA_MAX_SECTORS	256
+#define ATA_MAX_SECTORS_EXT	65536
+
 #define ATAPI_COMMAND_IDENTIFY 0xa1
 #define ATAPI_COMMAND_PACKET   0xa0
 
@@ -75,6 +97,19 @@ See the file LICENSE for details.
 
 static const int ata_base[4] = { ATA_BASE0, ATA_BASE0, ATA_BASE1, ATA_BASE1 };
 
+/*
+What each unit reported at probe time: whether it takes 48-bit
+addresses, and how many sectors it moves per data request under
+READ/WRITE MULTIPLE, or zero if it moves them one at a time.
+Each controller also remembers which of its two units was last
+selected, so that back to back commands to the same unit can
+skip selecting it again.
+*/
+
+static int ata_lba48[4] = { 0, 0, 0, 0 };
+static int ata_multiple[4] = { 0, 0, 0, 0 };
+static int ata_selected[2] = { -1, -1 };
+
 static int ata_interrupt_active = 0;
 static struct list queue = { 0, 0 };
 
@@ -96,6 +131,7 @@ static void ata_interrupt(int intr, int code)
 
 void ata_reset(int id)
 {
+	ata_selected[id / 2] = -1;
 	outb(ATA_CONTROL_RESET, ata_base[id] + ATA_CONTROL);
 	clock_wait(1);
 	outb(0, ata_base[id] + ATA_CONTROL);
@@ -136,22 +172,17 @@ static int ata_wait(int id, int mask, int state)
 
 static void ata_pio_read(int id, void *buffer, int size)
 {
-	uint16_t *wbuffer = (uint16_t *) buffer;
-	while(size > 0) {
-		*wbuffer = inw(ata_base[id] + ATA_DATA);
-		wbuffer++;
-		size -= 2;
-	}
+	insw(ata_base[id] + ATA_DATA, buffer, size / 2);
 }
 
 static void ata_pio_write(int id, const void *buffer, int size)
 {
-	uint16_t *wbuffer = (uint16_t *) buffer;
-	while(size > 0) {
-		outw(*wbuffer, ata_base[id] + ATA_DATA);
-		wbuffer++;
-		size -= 2;
-	}
+	outsw(ata_base[id] + ATA_DATA, buffer, size / 2);
+}
+
+static int ata_command_ext(int command)
+{
+	return command == ATA_COMMAND_READ_EXT || command == ATA_COMMAND_WRITE_EXT || command == ATA_COMMAND_READ_MULTIPLE_EXT || command == ATA_COMMAND_WRITE_MULTIPLE_EXT;
 }
 
 static int ata_begin(int id, int command, int nblocks, int offset)
@@ -170,14 +201,15 @@ static int ata_begin(int id, int command, int nblocks, int offset)
 	sector = (offset >> 0) & 0xff;
 	clow = (offset >> 8) & 0xff;
 	chigh = (offset >> 16) & 0xff;
-	flags |= (offset >> 24) & 0x0f;
-
-	// wait for the disk to calm down
-	if(!ata_wait(id, ATA_STATUS_BSY, 0))
-		return 0;
 
-	// get the attention of the proper disk
-	outb(flags, base + ATA_FDH);
+	// get the attention of the proper disk, once the controller has calmed down,
+	// unless the last command already went to it
+	if(ata_selected[id / 2] != id) {
+		if(!ata_wait(id, ATA_STATUS_BSY, 0))
+			return 0;
+		outb(flags, base + ATA_FDH);
+		ata_selected[id / 2] = id;
+	}
 
 	// wait again for the disk to indicate ready
 	// special case: ATAPI identification does not raise RDY flag
@@ -192,9 +224,17 @@ static int ata_begin(int id, int command, int nblocks, int offset)
 	if(!ready)
 		return 0;
 
-	// send the arguments
+	// send the arguments, for a 48-bit address the high bytes first
 	outb(0, base + ATA_CONTROL);
-	outb(nblocks, base + ATA_COUNT);
+	if(ata_command_ext(command)) {
+		outb((nblocks >> 8) & 0xff, base + ATA_COUNT);
+		outb((offset >> 24) & 0xff, base + ATA_SECTOR);
+		outb(0, base + ATA_CYL_LO);
+		outb(0, base + ATA_CYL_HI);
+	} else {
+		flags |= (offset >> 24) & 0x0f;
+	}
+	outb(nblocks & 0xff, base + ATA_COUNT);
 	outb(sector, base + ATA_SECTOR);
 	outb(clow, base + ATA_CYL_LO);
 	outb(chigh, base + ATA_CYL_HI);
@@ -206,27 +246,58 @@ static int ata_begin(int id, int command, int nblocks, int offset)
 	return 1;
 }
 
+/*
+Picks the command to read or write with on a unit: the MULTIPLE
+variants if it moves several sectors per data request, and the EXT
+variants if it takes 48-bit addresses.  A request is split into
+as many commands as the count register requires, and each command
+into data requests of ata_multiple[id] sectors, or one.
+*/
+
+static int ata_command_rw(int id, int write)
+{
+	if(ata_lba48[id]) {
+		if(ata_multiple[id])
+			return write ? ATA_COMMAND_WRITE_MULTIPLE_EXT : ATA_COMMAND_READ_MULTIPLE_EXT;
+		return write ? ATA_COMMAND_WRITE_EXT : ATA_COMMAND_READ_EXT;
+	} else {
+		if(ata_multiple[id])
+			return write ? ATA_COMMAND_WRITE_MULTIPLE : ATA_COMMAND_READ_MULTIPLE;
+		return write ? ATA_COMMAND_WRITE : ATA_COMMAND_READ;
+	}
+}
+
+static int ata_max_sectors(int id)
+{
+	return ata_lba48[id] ? ATA_MAX_SECTORS_EXT : ATA_MAX_SECTORS;
+}
+
 static int ata_read_unlocked(int id, void *buffer, int nblocks, int offset)
 {
-	int i;
-	if(!ata_begin(id, ATA_COMMAND_READ, nblocks, offset))
-		return 0;
+	int per_drq = ata_multiple[id] ? ata_multiple[id] : 1;
+	int done, i, n, count;
 
-	// XXX On fast virtual hardware, waiting for the interrupt
-	// doesn't work b/c it has already arrived before we get here.
-	// For now, busy wait until a fix is in place.
+	for(done = 0; done < nblocks; done += n) {
+		n = MIN(nblocks - done, ata_max_sectors(id));
+		if(!ata_begin(id, ata_command_rw(id, 0), n, offset + done))
+			return 0;
 
-	// if(ata_interrupt_active) process_wait(&queue);
+		// XXX On fast virtual hardware, waiting for the interrupt
+		// doesn't work b/c it has already arrived before we get here.
+		// For now, busy wait until a fix is in place.
 
-	for(i = 0; i < nblocks; i++) {
-		if(!ata_wait(id, ATA_STATUS_DRQ, ATA_STATUS_DRQ))
+		// if(ata_interrupt_active) process_wait(&queue);
+
+		for(i = 0; i < n; i += count) {
+			count = MIN(per_drq, n - i);
+			if(!ata_wait(id, ATA_STATUS_BSY | ATA_STATUS_DRQ, ATA_STATUS_DRQ))
+				return 0;
+			ata_pio_read(id, buffer, count * ATA_BLOCKSIZE);
+			buffer = ((char *) buffer) + count * ATA_BLOCKSIZE;
+		}
+		if(!ata_wait(id, ATA_STATUS_BSY, 0))
 			return 0;
-		ata_pio_read(id, buffer, ATA_BLOCKSIZE);
-		buffer = ((char *) buffer) + ATA_BLOCKSIZE;
-		offset++;
 	}
-	if(!ata_wait(id, ATA_STATUS_BSY, 0))
-		return 0;
 	return nblocks;
 }
 
@@ -262,6 +333,7 @@ static int atapi_begin(int id, void *data, int length)
 
 	// get the attention of the proper disk
 	outb(flags, base + ATA_FDH);
+	ata_selected[id / 2] = id;
 
 	// wait again for the disk to indicate ready
 	if(!ata_wait(id, ATA_STATUS_BSY, 0))
@@ -342,24 +414,29 @@ int atapi_read(int id, void *buffer, int nblocks, int offset)
 
 static int ata_write_unlocked(int id, const void *buffer, int nblocks, int offset)
 {
-	int i;
-	if(!ata_begin(id, ATA_COMMAND_WRITE, nblocks, offset))
-		return 0;
-	for(i = 0; i < nblocks; i++) {
-		if(!ata_wait(id, ATA_STATUS_DRQ, ATA_STATUS_DRQ))
+	int per_drq = ata_multiple[id] ? ata_multiple[id] : 1;
+	int done, i, n, count;
+
+	for(done = 0; done < nblocks; done += n) {
+		n = MIN(nblocks - done, ata_max_sectors(id));
+		if(!ata_begin(id, ata_command_rw(id, 1), n, offset + done))
 			return 0;
-		ata_pio_write(id, buffer, ATA_BLOCKSIZE);
-		buffer = ((char *) buffer) + ATA_BLOCKSIZE;
-		offset++;
-	}
-	// XXX On fast virtual hardware, waiting for the interrupt
-	// doesn't work b/c it has already arrived before we get here.
-	// For now, busy wait until a fix is in place.
+		for(i = 0; i < n; i += count) {
+			count = MIN(per_drq, n - i);
+			if(!ata_wait(id, ATA_STATUS_BSY | ATA_STATUS_DRQ, ATA_STATUS_DRQ))
+				return 0;
+			ata_pio_write(id, buffer, count * ATA_BLOCKSIZE);
+			buffer = ((const char *) buffer) + count * ATA_BLOCKSIZE;
+		}
+		// XXX On fast virtual hardware, waiting for the interrupt
+		// doesn't work b/c it has already arrived before we get here.
+		// For now, busy wait until a fix is in place.
 
-	// if(ata_interrupt_active) process_wait(&queue);
+		// if(ata_interrupt_active) process_wait(&queue);
 
-	if(!ata_wait(id, ATA_STATUS_BSY, 0))
-		return 0;
+		if(!ata_wait(id, ATA_STATUS_BSY, 0))
+			return 0;
+	}
 	return nblocks;
 }
 
@@ -400,6 +477,20 @@ static int ata_identify(int id, int command, void *buffer)
 }
 
 
+/*
+Asks the drive to move count sectors per data request under
+READ/WRITE MULTIPLE, and returns true if it agreed.
+*/
+
+static int ata_set_multiple(int id, int count)
+{
+	int result;
+	identify_in_progress = 1;
+	result = ata_begin(id, ATA_COMMAND_SET_MULTIPLE, count, 0) && ata_wait(id, ATA_STATUS_BSY, 0);
+	identify_in_progress = 0;
+	return result;
+}
+
 static int ata_probe_internal( int id, int kind, int *nblocks, int *blocksize, char *name )
 {
 	uint16_t buffer[256];
@@ -429,11 +520,30 @@ static int ata_probe_internal( int id, int kind, int *nblocks, int *blocksize, c
 	if(kind==ATA_COMMAND_IDENTIFY || kind==0) {
 		result = ata_identify(id, ATA_COMMAND_IDENTIFY, cbuffer);
 		if(result) {
-			*nblocks = buffer[1] * buffer[3] * buffer[6];
+			uint32_t sectors;
+			const uint16_t *w;
+
 			printf("%d logical cylinders\n", buffer[1]);
 			printf("%d logical heads\n", buffer[3]);
 			printf("%d logical sectors/track\n", buffer[6]);
+
+			// Prefer the linear sector counts to the geometry, 48-bit if supported.
+			ata_lba48[id] = (buffer[ATA_IDENTIFY_FEATURES] & ATA_FEATURE_LBA48) != 0;
+			if(ata_lba48[id]) {
+				w = &buffer[ATA_IDENTIFY_LBA48_SECTORS];
+				sectors = (w[2] || w[3]) ? 0x7fffffff : (w[0] | ((uint32_t) w[1] << 16));
+			} else {
+				w = &buffer[ATA_IDENTIFY_LBA28_SECTORS];
+				sectors = w[0] | ((uint32_t) w[1] << 16);
+			}
+			if(!sectors)
+				sectors = buffer[1] * buffer[3] * buffer[6];
+			*nblocks = MIN(sectors, 0x7fffffff);
 			*blocksize = ATA_BLOCKSIZE;
+
+			int multiple = buffer[ATA_IDENTIFY_MULTIPLE_MAX] & 0xff;
+			ata_multiple[id] = (multiple > 1 && ata_set_multiple(id, multiple)) ? multiple : 0;
+			printf("%s addressing, %d sectors per transfer\n", ata_lba48[id] ? "48-bit" : "28-bit", ata_multiple[id] ? ata_multiple[id] : 1);
 		}
 	}
 
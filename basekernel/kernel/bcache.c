@@ -7,76 +7,378 @@ See the file LICENSE for details.
 #include "bcache.h"
 #include "list.h"
 #include "page.h"
-#include "kmalloc.h"
+#include "slab.h"
 #include "string.h"
 #include "kernel/error.h"
+#include "console.h"
+#include "process.h"
+#include "clock.h"
+
+/*
+Entries are kept in LRU order on one list, most recently used
+first, and chained by device and block in a hash table, so that
+a hit costs one short chain walk and moves the entry to the head.
+Dirty entries are also kept on a list of their own, so that a
+flush visits only the blocks that need to be written.
+*/
+
+#define BCACHE_BUCKETS 4096
+
+/*
+The cache is limited to a fraction of memory, set at boot and
+adjustable with bcache_set_size.  Under memory pressure, the page
+allocator also calls bcache_reclaim to take back the least
+recently used blocks.  It only drops clean ones, and leaves the
+dirty ones to the flusher, unless memory has run out altogether.
+Blocks being read or written are busy, and are never evicted from
+under the caller.
+*/
+
+#define BCACHE_MEMORY_FRACTION 8
+#define BCACHE_MIN_SIZE 16
+
+/*
+Dirty blocks are written back by a flusher kernel thread, not by
+the process that happens to evict them.  The flusher wakes every
+BCACHE_FLUSH_INTERVAL and writes the blocks dirty for longer than
+BCACHE_DIRTY_EXPIRE, oldest first, since the dirty list is kept in
+the order blocks became dirty.  Each write takes along the dirty
+blocks that follow on the same device, up to BCACHE_RUN_MAX of them,
+as one request.  Once more than BCACHE_DIRTY_BACKGROUND percent of
+the cache is dirty, writers wake the flusher at once, and past
+BCACHE_DIRTY_LIMIT percent they wait for it to catch up.
+Eviction by a writer then only ever drops clean blocks.
+
+Reads go the other way through the same buffer: bcache_readahead
+fetches the uncached blocks of a range in runs of up to
+BCACHE_RUN_MAX, one request each, and leaves them in the cache
+marked as read ahead, so that the first read of each is counted
+as a read-ahead hit, and its eviction unread as a read-ahead miss.
+*/
+
+#define BCACHE_FLUSH_INTERVAL 1000
+#define BCACHE_DIRTY_EXPIRE 3000
+#define BCACHE_DIRTY_BACKGROUND 10
+#define BCACHE_DIRTY_LIMIT 40
+#define BCACHE_RUN_MAX 16
+#define BCACHE_RUN_ORDER 4	// BCACHE_RUN_MAX pages
 
 struct bcache_entry {
 	struct list_node node;
+	struct list_node dirty_node;
+	struct bcache_entry *hash_next;
 	struct device *device;
 	int block;
 	int dirty;
+	uint32_t dirty_time;
+	int busy;
+	int readahead;	// read ahead and not yet read
 	char *data;
 };
 
+#define bcache_entry_from_dirty(n) ((struct bcache_entry *) ((char *) (n) - __builtin_offsetof(struct bcache_entry, dirty_node)))
+
+static struct kmem_cache bcache_entry_cache = KMEM_CACHE_INIT("bcache_entry", sizeof(struct bcache_entry));
 static struct list cache = LIST_INIT;
+static struct list dirty_list = LIST_INIT;
+static struct bcache_entry *buckets[BCACHE_BUCKETS] = {0};
 static struct bcache_stats stats = {0};
 static int max_cache_size = 100;
 
-struct bcache_entry * bcache_entry_create( struct device *device, int block )
+static struct process *flusher = 0;
+static struct list flusher_queue = LIST_INIT;
+static struct list throttle_queue = LIST_INIT;
+static int reclaim_wanted = 0;	// pages the flusher should free by writing back
+static char *run_buffer = 0;
+static int run_buffer_busy = 0;
+
+struct bcache_entry * bcache_find( struct device *device, int block );
+void bcache_trim();
+static int bcache_evict( int count, int writeback );
+
+static struct bcache_entry **bcache_bucket( struct device *device, int block )
+{
+	uint32_t h = ((uint32_t) device >> 4) * 31 + block;
+	return &buckets[h % BCACHE_BUCKETS];
+}
+
+/* Allocates an entry that is not yet in the cache, so that no one else can find it. */
+
+static struct bcache_entry * bcache_entry_alloc( struct device *device, int block )
 {
-	struct bcache_entry *e = kmalloc(sizeof(*e));
+	struct bcache_entry *e = kmem_cache_alloc(&bcache_entry_cache);
 	if(!e) return 0;
 
 	e->device = device;
 	e->block = block;
+	e->dirty = 0;
+	e->busy = 0;
+	e->readahead = 0;
+	e->dirty_node.list = 0;
 	e->data = page_alloc(1);
 	if(!e->data) {
-		kfree(e);
+		kmem_cache_free(&bcache_entry_cache, e);
 		return 0;
 	}
 
 	return e;
+}
+
+static void bcache_entry_insert( struct bcache_entry *e )
+{
+	struct bcache_entry **b = bcache_bucket(e->device, e->block);
+	e->hash_next = *b;
+	*b = e;
+	list_push_head(&cache, &e->node);
+	if(list_size(&cache) > stats.high_watermark)
+		stats.high_watermark = list_size(&cache);
+}
+
+static void bcache_entry_free( struct bcache_entry *e )
+{
+	page_free(e->data);
+	kmem_cache_free(&bcache_entry_cache, e);
+}
 
+struct bcache_entry * bcache_entry_create( struct device *device, int block )
+{
+	struct bcache_entry *e = bcache_entry_alloc(device, block);
+	if(e) bcache_entry_insert(e);
+	return e;
 }
 
 void bcache_entry_delete( struct bcache_entry *e )
 {
 	if(e) {
+		struct bcache_entry **p = bcache_bucket(e->device, e->block);
+		while(*p != e) p = &(*p)->hash_next;
+		*p = e->hash_next;
+
+		list_remove(&e->node);
+		list_remove(&e->dirty_node);
+		if(e->readahead) stats.readahead_misses++;
 		if(e->data) page_free(e->data);
-		kfree(e);
+		kmem_cache_free(&bcache_entry_cache, e);
+	}
+}
+
+static void bcache_entry_dirty( struct bcache_entry *e )
+{
+	if(!e->dirty) {
+		e->dirty = 1;
+		e->dirty_time = clock_micros();
+		list_push_tail(&dirty_list, &e->dirty_node);
+	}
+}
+
+/*
+Writes back e along with the dirty blocks that follow it on the
+same device, and returns how many blocks were written.  A run of
+more than one block is copied into run_buffer to go out as one
+request; if another writer has the buffer, e goes alone.
+*/
+
+static int bcache_write_run( struct bcache_entry *e )
+{
+	struct bcache_entry *run[BCACHE_RUN_MAX];
+	int bs = device_block_size(e->device);
+	int n = 1, i;
+
+	if(run_buffer && !run_buffer_busy && bs <= PAGE_SIZE) {
+		while(n < BCACHE_RUN_MAX) {
+			struct bcache_entry *f = bcache_find(e->device, e->block + n);
+			if(!f || !f->dirty || f->busy) break;
+			run[n++] = f;
+		}
+	}
+	run[0] = e;
+
+	for(i = 0; i < n; i++) {
+		run[i]->dirty = 0;
+		list_remove(&run[i]->dirty_node);
+		run[i]->busy++;
+	}
+
+	if(n == 1) {
+		device_write(e->device,e->data,1,e->block);
+	} else {
+		run_buffer_busy = 1;
+		for(i = 0; i < n; i++) {
+			memcpy(run_buffer + i * bs, run[i]->data, bs);
+		}
+		device_write(e->device,run_buffer,n,e->block);
+		run_buffer_busy = 0;
 	}
+	// XXX How to deal with failure here?
+
+	for(i = 0; i < n; i++) {
+		run[i]->busy--;
+	}
+	stats.writebacks += n;
+
+	return n;
 }
 
 void bcache_entry_clean( struct bcache_entry *e )
 {
 	if(e->dirty) {
-		device_write(e->device,e->data,1,e->block);
-		// XXX How to deal with failure here?
-		e->dirty = 0;
-		stats.writebacks++;
+		bcache_write_run(e);
 	}
 
 }
 
-void bcache_trim()
+static int bcache_dirty_over( int percent )
+{
+	return list_size(&dirty_list) * 100 > max_cache_size * percent;
+}
+
+/*
+Writes back the blocks that have been dirty too long, and more if
+too much of the cache is dirty, then lets throttled writers go on.
+*/
+
+static void bcache_flush_expired()
+{
+	struct list_node *n = dirty_list.head;
+	struct bcache_entry *e;
+
+	while(n) {
+		e = bcache_entry_from_dirty(n);
+		if(!bcache_dirty_over(BCACHE_DIRTY_BACKGROUND) && (int32_t) (clock_micros() - e->dirty_time) < BCACHE_DIRTY_EXPIRE * 1000) {
+			break;
+		}
+		if(e->busy) {
+			n = n->next;
+		} else {
+			// The list may change while the blocks are written, so start over after each run.
+			bcache_write_run(e);
+			process_wakeup_all(&throttle_queue);
+			n = dirty_list.head;
+		}
+	}
+
+	process_wakeup_all(&throttle_queue);
+}
+
+static void bcache_flusher( void *arg )
+{
+	while(1) {
+		bcache_flush_expired();
+		if(list_size(&cache) > max_cache_size)
+			bcache_trim();
+		if(reclaim_wanted) {
+			int pages = reclaim_wanted;
+			reclaim_wanted = 0;
+			bcache_evict(pages, 1);
+		}
+		clock_wait_queue(&flusher_queue, BCACHE_FLUSH_INTERVAL);
+	}
+}
+
+/* Called after a block is dirtied: wakes the flusher, or waits for it, as needed. */
+
+static void bcache_throttle()
+{
+	if(!flusher || current == flusher) {
+		return;
+	}
+
+	if(bcache_dirty_over(BCACHE_DIRTY_BACKGROUND)) {
+		process_wakeup_all(&flusher_queue);
+	}
+
+	while(bcache_dirty_over(BCACHE_DIRTY_LIMIT)) {
+		process_wakeup_all(&flusher_queue);
+		process_wait(&throttle_queue);
+	}
+}
+
+/*
+Evicts up to count of the least recently used entries, and returns
+how many went.  Dirty entries are written back first if writeback
+is set, and skipped otherwise.
+*/
+
+static int bcache_evict( int count, int writeback )
 {
+	struct list_node *n = cache.tail;
 	struct bcache_entry *e;
+	int evicted = 0;
 
-	while(list_size(&cache)>max_cache_size) {
-		e = (struct bcache_entry *) list_pop_tail(&cache);
-		bcache_entry_clean(e);
-		bcache_entry_delete(e);
+	while(n && evicted < count) {
+		e = (struct bcache_entry *) n;
+		if(e->busy || (e->dirty && !writeback)) {
+			n = n->prev;
+		} else if(e->dirty) {
+			// The list may change while the block is written, so look again from the end.
+			bcache_entry_clean(e);
+			n = cache.tail;
+		} else {
+			n = n->prev;
+			bcache_entry_delete(e);
+			stats.evictions++;
+			evicted++;
+		}
 	}
+
+	return evicted;
+}
+
+/*
+Only the flusher writes back to make room.  Others drop clean blocks,
+and if too few are clean, leave the cache over its limit until the
+flusher has been.
+*/
+
+void bcache_trim()
+{
+	int excess = list_size(&cache) - max_cache_size;
+	if(excess <= 0) return;
+
+	int writeback = !flusher || current == flusher;
+	if(bcache_evict(excess, writeback) < excess) {
+		process_wakeup_all(&flusher_queue);
+	}
+}
+
+static int bcache_reclaim( int pages, int urgent )
+{
+	int freed = bcache_evict(pages, 0);
+	if(freed < pages) {
+		if(urgent || !flusher) {
+			freed += bcache_evict(pages - freed, 1);
+		} else {
+			reclaim_wanted = pages - freed;
+			process_wakeup_all(&flusher_queue);
+		}
+	}
+	return freed;
+}
+
+void bcache_init()
+{
+	uint32_t ntotal;
+	page_stats(0, &ntotal, 0);
+	bcache_set_size(ntotal / BCACHE_MEMORY_FRACTION);
+	page_reclaim_register(bcache_reclaim);
+	run_buffer = page_alloc_contig(BCACHE_RUN_ORDER);
+	flusher = process_create_kthread(bcache_flusher, 0);
+	printf("bcache: up to %d blocks\n", max_cache_size);
+}
+
+int bcache_set_size( int blocks )
+{
+	if(blocks < BCACHE_MIN_SIZE) blocks = BCACHE_MIN_SIZE;
+	max_cache_size = blocks;
+	bcache_trim();
+	return max_cache_size;
 }
 
 struct bcache_entry * bcache_find( struct device *device, int block )
 {
-	struct list_node *n;
 	struct bcache_entry *e;
 
-	for(n=cache.head;n;n=n->next) {
-		e = (struct bcache_entry *)n;
+	for(e = *bcache_bucket(device, block); e; e = e->hash_next) {
 		if(e->device==device && e->block==block) {
 			return e;
 		}
@@ -90,44 +392,131 @@ struct bcache_entry * bcache_find_or_create( struct device *device, int block, i
 	struct bcache_entry *e = bcache_find(device,block);
 	if(e) {
 		*was_a_hit = 1;
+		list_remove(&e->node);
+		list_push_head(&cache,&e->node);
 	} else {
 		*was_a_hit = 0;
 		e = bcache_entry_create(device,block);
 		if(!e) return 0;
-		list_push_head(&cache,&e->node);
 	}
 
+	e->busy++;
 	bcache_trim();
+	e->busy--;
 
 	return e;
 }
 
+/*
+On a miss, the read may yield, so the new entry only joins the cache
+once its data is in, as in bcache_readahead.  If someone else cached
+the block in the meantime, perhaps by writing it, that entry wins.
+*/
+
 int bcache_read_block( struct device *device, char *data, int block )
 {
-	int hit=0;
+	int bs = device_block_size(device);
 	int result;
 
-	struct bcache_entry *e = bcache_find_or_create(device,block,&hit);
+	struct bcache_entry *e = bcache_find(device,block);
+	if(e) {
+		stats.read_hits++;
+		if(e->readahead) {
+			stats.readahead_hits++;
+			e->readahead = 0;
+		}
+		list_remove(&e->node);
+		list_push_head(&cache,&e->node);
+		memcpy(data,e->data,bs);
+		return 1;
+	}
+
+	stats.read_misses++;
+	e = bcache_entry_alloc(device,block);
 	if(!e) return KERROR_OUT_OF_MEMORY;
 
-	if(hit) {
-		stats.read_hits++;
-		result = 1;
-	} else {
-		stats.read_misses++;
-		result = device_read(device,e->data,1,block);
+	result = device_read(device,e->data,1,block);
+	if(result<=0) {
+		bcache_entry_free(e);
+		return result;
 	}
 
-	if(result>0) {
-		memcpy(data,e->data,device_block_size(device));
+	struct bcache_entry *f = bcache_find(device,block);
+	if(f) {
+		bcache_entry_free(e);
+		e = f;
 	} else {
-		list_remove(&e->node);
-		bcache_entry_delete(e);
+		bcache_entry_insert(e);
 	}
+	memcpy(data,e->data,bs);
+
+	e->busy++;
+	bcache_trim();
+	e->busy--;
 
 	return result;
 }
 
+/*
+Brings the uncached blocks among count blocks from block into the
+cache, each contiguous run of them with one request through
+run_buffer, and returns how many were read.  These are not counted
+as misses, since no one has asked for them yet.  Gives up quietly
+when the buffer is in use or memory is short, since the blocks
+will still be read one by one on demand.
+
+The read may yield, so the new entries only join the cache once
+their data is in.  A block that someone else read or wrote in the
+meantime is already cached by then, and that entry is left alone.
+*/
+
+int bcache_readahead( struct device *device, int block, int count )
+{
+	struct bcache_entry *run[BCACHE_RUN_MAX];
+	int bs = device_block_size(device);
+	int total = 0;
+	int n, i, result;
+
+	if(!run_buffer || bs > PAGE_SIZE) return 0;
+
+	while(count > 0 && !run_buffer_busy) {
+		while(count > 0 && bcache_find(device, block)) {
+			block++;
+			count--;
+		}
+
+		n = 0;
+		while(n < count && n < BCACHE_RUN_MAX && !bcache_find(device, block + n)) {
+			struct bcache_entry *e = bcache_entry_alloc(device, block + n);
+			if(!e) break;
+			run[n++] = e;
+		}
+		if(n == 0) break;
+
+		run_buffer_busy = 1;
+		result = device_read(device, run_buffer, n, block);
+		run_buffer_busy = 0;
+
+		for(i = 0; i < n; i++) {
+			if(result > 0 && !bcache_find(device, block + i)) {
+				memcpy(run[i]->data, run_buffer + i * bs, bs);
+				run[i]->readahead = 1;
+				bcache_entry_insert(run[i]);
+			} else {
+				bcache_entry_free(run[i]);
+			}
+		}
+		if(result <= 0) break;
+
+		total += n;
+		block += n;
+		count -= n;
+	}
+
+	bcache_trim();
+	return total;
+}
+
 int bcache_read( struct device *device, char *data, int blocks, int offset )
 {
 	int i,r;
@@ -157,12 +546,14 @@ int bcache_write_block( struct device *device, const char *data, int block )
 
 	if(hit) {
 		stats.write_hits++;
+		e->readahead = 0;
 	} else {
 		stats.write_misses++;
 	}
 
 	memcpy(e->data,data,device_block_size(device));
-	e->dirty = 1;
+	bcache_entry_dirty(e);
+	bcache_throttle();
 
 	return 1;
 }
@@ -199,10 +590,15 @@ void bcache_flush_device( struct device *device )
 	struct list_node *n;
 	struct bcache_entry *e;
 
-	for(n=cache.head;n;n=n->next) {
-		e = (struct bcache_entry *) n;
+	// The list may change while a block is written, so start over after each.
+	n = dirty_list.head;
+	while(n) {
+		e = bcache_entry_from_dirty(n);
 		if(e->device==device) {
 			bcache_entry_clean(e);
+			n = dirty_list.head;
+		} else {
+			n = n->next;
 		}
 	}
 }
@@ -210,15 +606,15 @@ void bcache_flush_device( struct device *device )
 void bcache_flush_all()
 {
 	struct list_node *n;
-	struct bcache_entry *e;
 
-	for(n=cache.head;n;n=n->next) {
-		e = (struct bcache_entry *) n;
-		bcache_entry_clean(e);
+	while((n = dirty_list.head)) {
+		bcache_entry_clean(bcache_entry_from_dirty(n));
 	}
 }
 
 void bcache_get_stats( struct bcache_stats *s )
 {
+	stats.size = list_size(&cache);
+	stats.limit = max_cache_size;
 	memcpy(s,&stats,sizeof(*s));
 }
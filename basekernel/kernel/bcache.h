@@ -10,8 +10,12 @@ See the file LICENSE for details.
 #include "device.h"
 #include "kernel/stats.h"
 
+void bcache_init();
+int  bcache_set_size( int blocks );
+
 int  bcache_read( struct device *d, char *data, int blocks, int offset );
 int  bcache_write( struct device *d, const char *data, int blocks, int offset );
+int  bcache_readahead( struct device *d, int block, int count );
 
 int  bcache_read_block( struct device *d, char *data, int block );
 int  bcache_write_block( struct device *d, const char *data, int block );
@@ -18,14 +18,19 @@ See the file LICENSE for details.
 
 static struct fs_dirent *cdrom_dirent_create(struct fs_volume *volume, int sector, int length, int isdir)
 {
-	struct fs_dirent *d = kmalloc(sizeof(*d));
+	struct fs_dirent *d = kmem_cache_alloc(&fs_dirent_cache);
 	if(!d) return 0;
 
 	d->volume = volume;
 	d->refcount = 1;
 	d->size = length;
 	d->isdir = isdir;
+	d->ra_next = 0;
+	d->ra_end = 0;
+	d->ra_window = 0;
 	d->cdrom.sector = sector;
+	// The starting sector uniquely identifies a file on the volume.
+	d->inumber = sector;
 
 	return d;
 }
@@ -40,6 +45,11 @@ static int cdrom_dirent_read_block(struct fs_dirent *d, char *buffer, uint32_t b
 	}
 }
 
+static int cdrom_dirent_readahead(struct fs_dirent *d, uint32_t blocknum, int count)
+{
+	return bcache_readahead(d->volume->device, d->cdrom.sector + blocknum, count);
+}
+
 static void fix_filename(char *name, int length)
 {
 	// Plain files typically end with a semicolon and version, remove it.
@@ -249,6 +259,7 @@ const static struct fs_ops cdrom_ops = {
 	.mkfile = 0,
 	.read_block = cdrom_dirent_read_block,
 	.write_block = 0,
+	.readahead = cdrom_dirent_readahead,
 	.list = cdrom_dirent_list,
 	.remove = 0,
 	.resize = 0,
@@ -8,37 +8,296 @@ See the file LICENSE for details.
 #include "clock.h"
 #include "ioports.h"
 #include "process.h"
-
-// Minimum PIT frequency is 18.2Hz.
-#define CLICKS_PER_SECOND 20   //changed to make OS more responsive, still need to test the consequences
+#include "kmalloc.h"
+#include "string.h"
 
 #define TIMER0		0x40
 #define TIMER_MODE	0x43
-#define SQUARE_WAVE     0x36
+#define ONE_SHOT        0x30
+#define TIMER_LATCH     0x00
 #define TIMER_FREQ	1193182
-#define TIMER_COUNT	(((unsigned)TIMER_FREQ)/CLICKS_PER_SECOND)
 
-static uint32_t clicks = 0;
+/*
+The PIT runs in one-shot mode and is programmed at each interrupt
+for the earlier of the next scheduler tick and the next sleeper's
+deadline.  While the processor is idle there is no scheduler tick,
+so it sleeps until the next deadline, or for the longest interval
+the counter allows.  After passing zero the counter wraps and runs
+on from 0xffff, and can be told apart from one still counting down
+only until it comes back down to the programmed count.  So the count
+is capped at a quarter of the range, which leaves three times the
+interval, about 41ms, for the interrupt to be serviced late, as it
+is while another processor holds the kernel lock, before time is lost.
+
+Once the local APIC timer is running, it gives the scheduler tick
+instead, with finer resolution and without port I/O, and the PIT
+is left to keep the time and wake sleepers.
+*/
+
+#define TIMER_COUNT_MIN 16
+#define TIMER_COUNT_MAX 0x4000
+
+#define TICK_MICROS (1000000 / CLICKS_PER_SECOND)
+
+// Sleeps longer than this are taken in pieces, to keep deadlines comparable.
+#define CLOCK_WAIT_CHUNK 1000000
+
 static uint32_t seconds = 0;
+static uint32_t cycles = 0;	// PIT cycles into the current second
+static uint32_t programmed = 0;	// count of the interval in progress
+static uint32_t ticks = 0;
+static uint32_t next_tick = 0;
+static int ticking = 0;
+static int apic_ticking = 0;
 
 static struct list queue = { 0, 0 };
 
-static void clock_interrupt(int i, int code)
+/*
+Sleeping processes are kept in a binary min-heap ordered by
+deadline, and each knows its own slot in the heap, so that
+expiry and cancellation are both logarithmic.  Deadlines are in
+microseconds modulo 2^32, and are compared by signed difference.
+The heap doubles in size when it fills, so that it costs only as
+much as the number of processes that have slept at once.
+*/
+
+#define TIMER_HEAP_INITIAL 64
+
+static struct process **timer_heap = 0;
+static int timer_count = 0;
+static int timer_capacity = 0;
+
+static int timer_before(struct process *a, struct process *b)
+{
+	return (int32_t) (a->sleep_deadline - b->sleep_deadline) < 0;
+}
+
+static void timer_place(int i, struct process *p)
 {
-	clicks++;
-	process_wakeup_all(&queue);
-	if(clicks >= CLICKS_PER_SECOND) {
-		clicks = 0;
+	timer_heap[i] = p;
+	p->sleep_slot = i;
+}
+
+static void timer_up(int i)
+{
+	struct process *p = timer_heap[i];
+	while(i > 0 && timer_before(p, timer_heap[(i - 1) / 2])) {
+		timer_place(i, timer_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	timer_place(i, p);
+}
+
+static void timer_down(int i)
+{
+	struct process *p = timer_heap[i];
+	while(1) {
+		int child = 2 * i + 1;
+		if(child >= timer_count)
+			break;
+		if(child + 1 < timer_count && timer_before(timer_heap[child + 1], timer_heap[child]))
+			child++;
+		if(!timer_before(timer_heap[child], p))
+			break;
+		timer_place(i, timer_heap[child]);
+		i = child;
+	}
+	timer_place(i, p);
+}
+
+static int timer_grow()
+{
+	int capacity = timer_capacity ? timer_capacity * 2 : TIMER_HEAP_INITIAL;
+	struct process **heap = kmalloc(capacity * sizeof(struct process *));
+	if(!heap)
+		return 0;
+	if(timer_heap) {
+		memcpy(heap, timer_heap, timer_count * sizeof(struct process *));
+		kfree(timer_heap);
+	}
+	timer_heap = heap;
+	timer_capacity = capacity;
+	return 1;
+}
+
+static void timer_insert(struct process *p)
+{
+	timer_place(timer_count++, p);
+	timer_up(p->sleep_slot);
+}
+
+static void timer_remove(struct process *p)
+{
+	int i = p->sleep_slot;
+	struct process *last = timer_heap[--timer_count];
+	if(i < timer_count) {
+		timer_place(i, last);
+		timer_up(i);
+		timer_down(last->sleep_slot);
+	}
+	p->sleep_slot = -1;
+}
+
+static uint32_t clock_block()
+{
+	uint32_t flags;
+	asm volatile("pushfl; popl %0; cli" : "=r"(flags));
+	return flags;
+}
+
+static void clock_unblock(uint32_t flags)
+{
+	asm volatile("pushl %0; popfl" : : "r"(flags) : "cc");
+}
+
+static uint32_t clock_counter()
+{
+	uint32_t count;
+	outb(TIMER_LATCH, TIMER_MODE);
+	count = inb(TIMER0);
+	count |= inb(TIMER0) << 8;
+	return count;
+}
+
+/* Returns the PIT cycles elapsed in the interval in progress. */
+
+static uint32_t clock_elapsed()
+{
+	uint32_t count;
+
+	if(!programmed)
+		return 0;
+
+	count = clock_counter();
+	if(count > 0 && count <= programmed) {
+		return programmed - count;
+	} else {
+		// The counter has passed zero and wrapped around.
+		return programmed + ((0x10000 - count) & 0xffff);
+	}
+}
+
+static uint32_t clock_micros_at(uint32_t s, uint32_t c)
+{
+	while(c >= TIMER_FREQ) {
+		c -= TIMER_FREQ;
+		s++;
+	}
+	uint32_t ms = c * 1000 / TIMER_FREQ;
+	uint32_t rem = c * 1000 % TIMER_FREQ;
+	return s * 1000000 + ms * 1000 + rem * 1000 / TIMER_FREQ;
+}
+
+/* Folds the interval in progress into the clock, which must be reprogrammed next. */
+
+static uint32_t clock_account()
+{
+	cycles += clock_elapsed();
+	programmed = 0;
+	while(cycles >= TIMER_FREQ) {
+		cycles -= TIMER_FREQ;
 		seconds++;
-		process_preempt();
 	}
+	return clock_micros_at(seconds, cycles);
+}
+
+static void clock_program(uint32_t now)
+{
+	uint32_t delay = 0xffffffff;
+	uint32_t count;
+
+	if(ticking)
+		delay = next_tick - now;
+
+	if(timer_count) {
+		int32_t d = timer_heap[0]->sleep_deadline - now;
+		if(d < 0)
+			d = 0;
+		if(d < delay)
+			delay = d;
+	}
+
+	if(delay > 50000)
+		delay = 50000;
+
+	// Multiply by TIMER_FREQ / 1000000 without overflowing.
+	count = delay + delay * 193 / 1000 + delay * 182 / 1000000;
+
+	if(count < TIMER_COUNT_MIN)
+		count = TIMER_COUNT_MIN;
+	if(count > TIMER_COUNT_MAX)
+		count = TIMER_COUNT_MAX;
+
+	programmed = count;
+	outb(ONE_SHOT, TIMER_MODE);
+	outb(count & 0xff, TIMER0);
+	outb((count >> 8) & 0xff, TIMER0);
+}
+
+static void clock_interrupt(int i, int code)
+{
+	uint32_t now = clock_account();
+	int tick = 0;
+
+	while(timer_count && (int32_t) (now - timer_heap[0]->sleep_deadline) >= 0) {
+		struct process *p = timer_heap[0];
+		timer_remove(p);
+		process_wakeup_one(p);
+	}
+
+	// Charge scheduler ticks only while some process is running.
+	if(!apic_ticking && current && current != cpu_self()->idle) {
+		if(!ticking) {
+			ticking = 1;
+			next_tick = now + TICK_MICROS;
+		} else if((int32_t) (now - next_tick) >= 0) {
+			next_tick += TICK_MICROS;
+			if((int32_t) (now - next_tick) >= 0)
+				next_tick = now + TICK_MICROS;
+			ticks++;
+			tick = 1;
+		}
+	} else {
+		ticking = 0;
+	}
+
+	clock_program(now);
+
+	if(tick)
+		process_tick();
 }
 
 clock_t clock_read()
 {
 	clock_t result;
-	result.seconds = seconds;
-	result.millis = 1000 * clicks / CLICKS_PER_SECOND;
+	uint32_t flags = clock_block();
+	uint32_t s = seconds;
+	uint32_t c = cycles + clock_elapsed();
+	clock_unblock(flags);
+
+	while(c >= TIMER_FREQ) {
+		c -= TIMER_FREQ;
+		s++;
+	}
+	result.seconds = s;
+	result.millis = c * 1000 / TIMER_FREQ;
+	return result;
+}
+
+/* Returns the number of scheduler ticks charged since boot. */
+
+uint32_t clock_ticks()
+{
+	return ticks;
+}
+
+/* Returns microseconds since boot, modulo 2^32, for measuring short intervals. */
+
+uint32_t clock_micros()
+{
+	uint32_t flags = clock_block();
+	uint32_t result = clock_micros_at(seconds, cycles + clock_elapsed());
+	clock_unblock(flags);
 	return result;
 }
 
@@ -54,24 +313,112 @@ clock_t clock_diff(clock_t start, clock_t stop)
 	return result;
 }
 
-void clock_wait(uint32_t millis)
+/* Puts current in the heap to be woken in micros; called with the clock blocked. */
+
+static int clock_timer_start(uint32_t micros)
+{
+	if(timer_count == timer_capacity && !timer_grow())
+		return 0;
+
+	current->sleep_deadline = clock_micros() + micros;
+	timer_insert(current);
+
+	// The new deadline may come before the interrupt already programmed.
+	if(timer_heap[0] == current) {
+		clock_program(clock_account());
+	}
+	return 1;
+}
+
+static void clock_sleep(uint32_t micros)
 {
-	clock_t start, elapsed;
-	uint32_t total;
+	uint32_t flags = clock_block();
+
+	if(!clock_timer_start(micros)) {
+		clock_unblock(flags);
+		return;
+	}
 
-	start = clock_read();
-	do {
+	while(current->sleep_slot >= 0) {
 		process_wait(&queue);
-		elapsed = clock_diff(start, clock_read());
-		total = elapsed.millis + elapsed.seconds * 1000;
-	} while(total < millis);
+		interrupt_block();
+	}
+
+	clock_unblock(flags);
+}
+
+void clock_wait(uint32_t millis)
+{
+	while(millis > 0) {
+		uint32_t chunk = millis > CLOCK_WAIT_CHUNK ? CLOCK_WAIT_CHUNK : millis;
+		clock_sleep(chunk * 1000);
+		millis -= chunk;
+	}
+}
+
+/*
+Waits in q until woken, or until millis have passed, when the
+clock wakes the process out of q itself.  Returns true if woken
+before the time ran out.  Longer waits end after CLOCK_WAIT_CHUNK.
+*/
+
+int clock_wait_queue(struct list *q, uint32_t millis)
+{
+	int woken;
+	uint32_t flags = clock_block();
+
+	if(millis > CLOCK_WAIT_CHUNK)
+		millis = CLOCK_WAIT_CHUNK;
+
+	if(!clock_timer_start(millis * 1000)) {
+		clock_unblock(flags);
+		return 0;
+	}
+
+	process_wait(q);
+	interrupt_block();
+
+	woken = current->sleep_slot >= 0;
+	if(woken)
+		timer_remove(current);
+
+	clock_unblock(flags);
+	return woken;
+}
+
+/* Removes a sleeping process that is being killed from the heap. */
+
+void clock_cancel(struct process *p)
+{
+	uint32_t flags = clock_block();
+	if(p->sleep_slot >= 0) {
+		timer_remove(p);
+	}
+	clock_unblock(flags);
+}
+
+/* Hands the scheduler tick over to the local APIC timer. */
+
+void clock_apic_start()
+{
+	uint32_t flags = clock_block();
+	apic_ticking = 1;
+	ticking = 0;
+	clock_unblock(flags);
+}
+
+/* Called for the APIC timer interrupt, on every processor. */
+
+void clock_apic_tick()
+{
+	if(cpu_self()->index == 0 && current && current != cpu_self()->idle)
+		ticks++;
+	process_tick();
 }
 
 void clock_init()
 {
-	outb(SQUARE_WAVE, TIMER_MODE);
-	outb((TIMER_COUNT & 0xff), TIMER0);
-	outb((TIMER_COUNT >> 8) & 0xff, TIMER0);
+	clock_program(0);
 
 	interrupt_register(32, clock_interrupt);
 	interrupt_enable(32);
@@ -9,14 +9,26 @@ See the file LICENSE for details.
 
 #include "kernel/types.h"
 
+struct process;
+struct list;
+
 typedef struct {
 	uint32_t seconds;
 	uint32_t millis;
 } clock_t;
 
+// Minimum PIT frequency is 18.2Hz.
+#define CLICKS_PER_SECOND 100
+
 void clock_init();
 clock_t clock_read();
+uint32_t clock_ticks();
+uint32_t clock_micros();
 clock_t clock_diff(clock_t start, clock_t stop);
 void clock_wait(uint32_t millis);
+int clock_wait_queue(struct list *q, uint32_t millis);
+void clock_cancel(struct process *p);
+void clock_apic_start();
+void clock_apic_tick();
 
 #endif
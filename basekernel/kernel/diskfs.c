@@ -252,7 +252,7 @@ int diskfs_inode_write( struct fs_dirent *d, struct diskfs_block *b, uint32_t bl
 
 struct fs_dirent * diskfs_dirent_create( struct fs_volume *volume, int inumber, int type )
 {
-	struct fs_dirent *d = kmalloc(sizeof(*d));
+	struct fs_dirent *d = kmem_cache_alloc(&fs_dirent_cache);
 	memset(d,0,sizeof(*d));
 
 	diskfs_inode_load(volume,inumber,&d->disk);
@@ -510,6 +510,48 @@ int diskfs_dirent_read_block( struct fs_dirent *d, char *data, uint32_t blockno
 	return diskfs_inode_read(d,(void*)data,blockno);
 }
 
+/*
+Maps the logical blocks to data blocks, and reads ahead each run
+of them that lies contiguous on disk with one request.
+*/
+
+int diskfs_dirent_readahead( struct fs_dirent *d, uint32_t blockno, int count )
+{
+	struct fs_volume *v = d->volume;
+	struct diskfs_block *b = 0;
+	uint32_t start = 0, length = 0, actual, block;
+	int total = 0;
+
+	for(block=blockno;block<blockno+count;block++) {
+		if(block<DISKFS_DIRECT_POINTERS) {
+			actual = d->disk.direct[block];
+		} else {
+			if(block-DISKFS_DIRECT_POINTERS>=DISKFS_POINTERS_PER_BLOCK) break;
+			if(!b) {
+				if(!d->disk.indirect) break;
+				b = page_alloc(0);
+				if(!b) break;
+				if(diskfs_data_block_read(v,b,d->disk.indirect)<0) break;
+			}
+			actual = b->pointers[block-DISKFS_DIRECT_POINTERS];
+		}
+
+		if(length>0 && actual==start+length && actual<v->disk.data_blocks) {
+			length++;
+			continue;
+		}
+		if(length>0) total += bcache_readahead(v->device,v->disk.data_start+start,length);
+
+		start = actual;
+		length = (actual>0 && actual<v->disk.data_blocks) ? 1 : 0;
+	}
+
+	if(length>0) total += bcache_readahead(v->device,v->disk.data_start+start,length);
+	if(b) page_free(b);
+
+	return total;
+}
+
 extern struct fs disk_fs;
 
 struct fs_volume * diskfs_volume_open( struct device *device )
@@ -641,6 +683,7 @@ struct fs_ops diskfs_ops = {
 	.mkfile = diskfs_dirent_create_file,
 	.read_block = diskfs_dirent_read_block,
 	.write_block = diskfs_dirent_write_block,
+	.readahead = diskfs_dirent_readahead,
 	.list = diskfs_dirent_list,
 	.remove = diskfs_dirent_remove,
 	.resize = diskfs_dirent_resize,
@@ -110,6 +110,28 @@ static int elf_ensure_address_space( struct process *p, uint32_t addr )
 	/* Return zero on success. */
 }
  
+/*
+Maps the pages of a section that is about to be read from the file.
+Only the pages at either end, which the section may not fill, need
+to be cleared: those in between are wholly overwritten by the read.
+*/
+
+static void elf_alloc_section(struct process *p, uint32_t address, uint32_t size)
+{
+	uint32_t start = address & ~(PAGE_SIZE - 1);
+	uint32_t end = (address + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uint32_t inner_start = (address + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uint32_t inner_end = (address + size) & ~(PAGE_SIZE - 1);
+
+	int mapped = 0;
+
+	if(inner_start < inner_end) {
+		mapped += pagetable_alloc(p->pagetable, inner_start, inner_end - inner_start, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_NOCLEAR);
+	}
+	mapped += pagetable_alloc(p->pagetable, start, end - start, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
+	process_resident_add(p, mapped);
+}
+
 int elf_load(struct process *p, struct fs_dirent *d, addr_t * entry)
 {
 	struct elf_header header;
@@ -134,26 +156,47 @@ int elf_load(struct process *p, struct fs_dirent *d, addr_t * entry)
 	if(program.type != ELF_PROGRAM_TYPE_LOADABLE || program.vaddr < PROCESS_ENTRY_POINT || program.memory_size > 0x8000000 || program.memory_size != program.file_size)
 		goto noexec;
 
-	process_data_size_set(p, program.memory_size);
+	if(program.offset + program.file_size > fs_dirent_size(d))
+		goto noload;
+
+	/*
+	Discard any previous image, and map the program segment lazily:
+	its pages are read from the file by the page fault handler on first touch.
+	*/
+
+	process_data_size_set(p, 0);
+	process_image_set(p, d, program.offset, program.vaddr, program.file_size, 0);
 
-	actual = fs_dirent_read(d, (char *) program.vaddr, program.memory_size, program.offset);
-	if(actual != program.memory_size)
-		goto mustdie;
+	/* The data size covers the image, but its pages stay unmapped until touched. */
+	uint32_t limit = program.vaddr + program.memory_size - PROCESS_ENTRY_POINT;
+	if(limit % PAGE_SIZE)
+		limit += PAGE_SIZE - limit % PAGE_SIZE;
+	p->vm_data_size = limit;
+
+	/* The image is read-only text up to the first writable section. */
+	uint32_t text_end = program.vaddr + program.file_size;
 
 	for(i = 0; i < header.shnum; i++) {
 		actual = fs_dirent_read(d, (char *) &section, sizeof(section), header.section_offset + i * header.shentsize);
 		if(actual != sizeof(section))
 			goto mustdie;
 
+		if(section.address != 0 && (section.flags & ELF_SECTION_FLAGS_WRITE || section.type == ELF_SECTION_TYPE_BSS)) {
+			text_end = MIN(text_end, MAX(section.address, program.vaddr));
+		}
+
 		if(section.type == ELF_SECTION_TYPE_BSS) {
 			/* For BSS, just clear that address space to zero. */
 			actual = elf_ensure_address_space(p,section.address+section.size);
 			if(actual!=0) goto nomem;
 			memset((void *) section.address, section.size, 0);
+		} else if(section.type == ELF_SECTION_TYPE_PROGRAM && section.address >= program.vaddr && section.address + section.size <= program.vaddr + program.file_size) {
+			/* Sections within the program segment are loaded on demand with it. */
 		} else if(section.type == ELF_SECTION_TYPE_PROGRAM && section.address!=0) {
 			/* For other loadable section types (usually data), load from file. */
 			actual = elf_ensure_address_space(p,section.address+section.size);
 			if(actual!=0) goto nomem;
+			elf_alloc_section(p, section.address, section.size);
 			actual = fs_dirent_read(d,(char*)section.address,section.size,section.offset);
 			if(actual != section.size) goto mustdie;
 		} else {
@@ -161,6 +204,8 @@ int elf_load(struct process *p, struct fs_dirent *d, addr_t * entry)
 		}
 	}
 
+	p->image_text_length = text_end - program.vaddr;
+
 	*entry = header.entry;
 	return 0;
 
@@ -2,7 +2,7 @@
 #include "interrupt.h"
 #include "process.h"
 #include "list.h"
-#include "kmalloc.h"
+#include "slab.h"
 
 #define EVENT_BUFFER_SIZE 32
 
@@ -16,6 +16,8 @@ struct event_queue {
 
 struct event_queue event_queue_root;
 
+static struct kmem_cache event_queue_cache = KMEM_CACHE_INIT("event_queue", sizeof(struct event_queue));
+
 struct event_queue * event_queue_create_root()
 {
 	memset(&event_queue_root,0,sizeof(event_queue_root));
@@ -24,14 +26,14 @@ struct event_queue * event_queue_create_root()
 
 struct event_queue * event_queue_create()
 {
-	struct event_queue *q = kmalloc(sizeof(*q));
+	struct event_queue *q = kmem_cache_alloc(&event_queue_cache);
 	memset(q,0,sizeof(*q));
 	return q;
 }
 
 void event_queue_delete( struct event_queue *q )
 {
-	kfree(q);
+	kmem_cache_free(&event_queue_cache, q);
 }
 
 /* INTERRUPT CONTEXT */
@@ -77,7 +79,7 @@ static int event_queue_read_raw( struct event_queue *q, struct event *e, int siz
 
 		if(q->head==q->tail) {
 			if(blocking && total==0) {
-				process_wait(&q->process_queue);
+				process_wait_interactive(&q->process_queue);
 				continue;
 			} else {
 				break;
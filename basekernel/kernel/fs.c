@@ -11,9 +11,12 @@ See the file LICENSE for details.
 #include "page.h"
 #include "process.h"
 #include "bcache.h"
+#include "pagecache.h"
 
 static struct fs *fs_list = 0;
 
+struct kmem_cache fs_dirent_cache = KMEM_CACHE_INIT("fs_dirent", sizeof(struct fs_dirent));
+
 static struct kobject * find_kobject_by_tag( const char *tag )
 {
 	int i;
@@ -153,6 +156,7 @@ int fs_volume_close(struct fs_volume *v)
 	v->refcount--;
 	if(v->refcount==0) {
 		v->fs->ops->volume_close(v);
+		pagecache_invalidate_volume(v);
 		bcache_flush_device(v->device);
 		device_close(v->device);
 		kfree(v);
@@ -242,12 +246,51 @@ int fs_dirent_close(struct fs_dirent *d)
 		ops->close(d);
 		// This close is paired with the addref in fs_dirent_lookup
 		fs_volume_close(d->volume);
-		kfree(d);
+		kmem_cache_free(&fs_dirent_cache, d);
 	}
 
 	return 0;
 }
 
+/*
+A reader that carries on from the block where its last read ended,
+or in the same block, is taken to be sequential, and the blocks
+ahead of it are read ahead, in a window that starts at
+FS_READAHEAD_MIN blocks and doubles with each sequential read up to
+FS_READAHEAD_MAX.  The next batch is issued once the reader is
+within half a window of the end of the last one.  Any other read
+closes the window, and only has the blocks it spans read together.
+*/
+
+#define FS_READAHEAD_MIN 4
+#define FS_READAHEAD_MAX 16
+
+static void fs_dirent_readahead(struct fs_dirent *d, uint32_t first, uint32_t last)
+{
+	const struct fs_ops *ops = d->volume->fs->ops;
+	uint32_t bs = d->volume->block_size;
+	uint32_t nblocks = (d->size + bs - 1) / bs;
+	uint32_t start, end;
+
+	if(first == d->ra_next || first + 1 == d->ra_next) {
+		d->ra_window = d->ra_window ? MIN(d->ra_window * 2, FS_READAHEAD_MAX) : FS_READAHEAD_MIN;
+	} else {
+		d->ra_window = 0;
+		d->ra_end = first;
+	}
+	d->ra_next = last + 1;
+
+	if(last + d->ra_window / 2 < d->ra_end)
+		return;
+
+	start = MAX(first, d->ra_end);
+	end = MIN(last + 1 + d->ra_window, nblocks);
+	if(end > start + 1) {
+		ops->readahead(d, start, end - start);
+	}
+	d->ra_end = MAX(end, d->ra_end);
+}
+
 int fs_dirent_read(struct fs_dirent *d, char *buffer, uint32_t length, uint32_t offset)
 {
 	int total = 0;
@@ -265,6 +308,10 @@ int fs_dirent_read(struct fs_dirent *d, char *buffer, uint32_t length, uint32_t
 		length = d->size - offset;
 	}
 
+	if(length > 0 && ops->readahead) {
+		fs_dirent_readahead(d, offset / bs, (offset + length - 1) / bs);
+	}
+
 	char *temp = page_alloc(0);
 	if(!temp)
 		return -1;
@@ -355,6 +402,9 @@ int fs_dirent_write(struct fs_dirent *d, const char *buffer, uint32_t length, ui
 
 	char *temp = page_alloc(0);
 
+	// cached pages of this file are about to become stale
+	pagecache_invalidate(d);
+
 	// if writing past the (current) end of the file, resize the file first
 	if (offset + length > d->size) {
 		ops->resize(d, offset+length);
@@ -10,6 +10,7 @@ See the file LICENSE for details.
 #include "fs.h"
 #include "cdromfs.h"
 #include "diskfs.h"
+#include "slab.h"
 
 struct fs {
 	char *name;
@@ -34,12 +35,22 @@ struct fs_dirent {
 	int inumber;
 	int refcount;
 	int isdir;
+	uint32_t ra_next;	// block after the last one read, to detect sequential reads
+	uint32_t ra_end;	// block after the last one read ahead
+	int ra_window;	// blocks to read ahead of a sequential reader
 	union {
 		struct cdrom_dirent cdrom;
 		struct diskfs_inode disk;
 	};
 };
 
+/*
+All fs_dirents are allocated from this cache, whichever
+filesystem creates them, because fs_dirent_close releases them.
+*/
+
+extern struct kmem_cache fs_dirent_cache;
+
 struct fs_ops {
 	struct fs_dirent *(*volume_root) (struct fs_volume *v);
 	struct fs_volume *(*volume_open) (struct device *d);
@@ -52,6 +63,7 @@ struct fs_ops {
 
 	int (*read_block) (struct fs_dirent *d, char *buffer, uint32_t blocknum);
 	int (*write_block) (struct fs_dirent *d, const char *buffer, uint32_t blocknum);
+	int (*readahead) (struct fs_dirent *d, uint32_t blocknum, int count);
 	int (*list) (struct fs_dirent *d, char *buffer, int buffer_length);
 	int (*remove) (struct fs_dirent *d, const char *name);
 	int (*resize) (struct fs_dirent *d, uint32_t blocks);
@@ -10,10 +10,25 @@ See the file LICENSE for details.
 #include "process.h"
 #include "kernelcore.h"
 #include "x86.h"
+#include "memorylayout.h"
+#include "apic.h"
+#include "ioapic.h"
 
-static interrupt_handler_t interrupt_handler_table[48];
-static uint32_t interrupt_count[48];
-static uint8_t interrupt_spurious[48];
+static interrupt_handler_t interrupt_handler_table[64];
+static uint32_t interrupt_count[64];
+static uint8_t interrupt_spurious[64];
+
+/*
+Hardware interrupts 32-47 come from the 8259 PIC at first.
+Once interrupt_use_ioapic is called, they come through the I/O APIC
+instead, from the pin given in ioapic_pin, and are acknowledged with
+a single write to the local APIC rather than port I/O to the PIC.
+interrupt_enabled remembers which lines are on, across the switch.
+*/
+
+static int ioapic_pin[16];
+static int ioapic_mode = 0;
+static uint16_t interrupt_enabled = 0;
 
 static const char *exception_names[] = {
 	"division by zero",
@@ -35,6 +50,10 @@ static const char *exception_names[] = {
 	"coprocessor error"
 };
 
+#define PAGE_FAULT_PRESENT 0x01	// set if the page was present, i.e. a protection violation
+#define PAGE_FAULT_WRITE   0x02	// set if the access was a write
+#define PAGE_FAULT_USER    0x04	// set if the access was made in user mode
+
 static void unknown_exception(int i, int code)
 {
 	unsigned vaddr; // virtual address trying to be accessed
@@ -43,9 +62,23 @@ static void unknown_exception(int i, int code)
 
 	if(i==14) {
 		asm("mov %%cr2, %0" : "=r" (vaddr) ); // virtual address trying to be accessed		
+
+		// A write to a page shared since fork gets a private copy.
+		// This may also happen in kernel mode, when a system call writes to user memory.
+		if((code & PAGE_FAULT_PRESENT) && (code & PAGE_FAULT_WRITE)) {
+			int copied = pagetable_copy_on_write(current->pagetable, vaddr);
+			if(copied >= 0) {
+				current->stats.pages_copied += copied;
+				current->stats.minor_faults++;
+				return;
+			}
+		}
+
 		esp  = ((struct x86_stack *)(current->kstack_top - sizeof(struct x86_stack)))->esp; // stack pointer of the process that raised the exception
 		// Check if the requested memory is in the stack or data
-		int data_access = vaddr < current->vm_data_size;
+		// Threads share the data segment and program image of their leader.
+		struct process *leader = current->leader;
+		int data_access = vaddr >= PROCESS_ENTRY_POINT && vaddr < PROCESS_ENTRY_POINT + leader->vm_data_size;
 
 		// Subtract 128 from esp because of the red-zone 
 		// According to https:gcc.gnu.org, the red zone is a 128-byte area beyond 
@@ -54,17 +87,37 @@ static void unknown_exception(int i, int code)
 		int stack_access = vaddr >= esp - 128; 
 
 		// Check if the requested memory is already in use
-		int page_already_present = pagetable_getmap(current->pagetable,vaddr,&paddr,0);
-		
+		int flags = 0;
+		int page_already_present = pagetable_getmap(current->pagetable,vaddr,&paddr,&flags);
+
+		// A page already mapped may have been mapped by another thread that faulted
+		// on it first.  Only if the mapping forbids this access is it an error;
+		// otherwise just retry the instruction.
+		int page_forbidden = ((code & PAGE_FAULT_WRITE) && !(flags & PAGE_FLAG_READWRITE))
+			|| ((code & PAGE_FAULT_USER) && (flags & PAGE_FLAG_KERNEL));
+
+		if (page_already_present && !page_forbidden) {
+			return;
+		}
+
 		// Check if page is already mapped (which will result from violating the permissions on page) or that
-		// we are accessing neither the stack nor the heap, or we are accessing both. If so, error
-		if (page_already_present || (data_access ^ stack_access)) {
+		// we are accessing neither the stack nor the heap. If so, error
+		if (page_already_present || !(data_access || stack_access)) {
 			printf("interrupt: illegal page access at vaddr %x\n",vaddr);
 			process_dump(current);
 			process_exit(0);
+		} else if (data_access && process_image_contains(leader, vaddr)) {
+			// First touch of a page of the program image: read it in from the file.
+			if(process_image_fault(leader, vaddr) < 0) {
+				printf("interrupt: couldn't load page at vaddr %x\n",vaddr);
+				process_exit(0);
+			}
+			current->stats.major_faults++;
+			return;
 		} else {
 			// XXX update process->vm_stack_size when growing the stack.
-			pagetable_alloc(current->pagetable, vaddr, PAGE_SIZE, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
+			process_resident_add(current, pagetable_alloc(current->pagetable, vaddr, PAGE_SIZE, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR));
+			current->stats.minor_faults++;
 			return;
 		}
 	} else {
@@ -97,8 +150,14 @@ static void interrupt_acknowledge(int i)
 {
 	if(i < 32) {
 		/* do nothing */
-	} else {
-		pic_acknowledge(i - 32);
+	} else if(i < 48) {
+		if(ioapic_mode) {
+			apic_eoi();
+		} else {
+			pic_acknowledge(i - 32);
+		}
+	} else if(i > 48 && i != APIC_SPURIOUS_VECTOR) {
+		apic_eoi();
 	}
 }
 
@@ -115,7 +174,7 @@ void interrupt_init()
 		interrupt_spurious[i] = 0;
 		interrupt_count[i] = 0;
 	}
-	for(i = 32; i < 48; i++) {
+	for(i = 32; i < 64; i++) {
 		interrupt_handler_table[i] = unknown_hardware;
 		interrupt_spurious[i] = 0;
 		interrupt_count[i] = 0;
@@ -126,31 +185,74 @@ void interrupt_init()
 	printf("interrupt: ready\n");
 }
 
+/*
+Acknowledge before running the handler: the clock handler may
+switch to another process, and until the interrupted one runs
+again the PIC would deliver no further interrupts of this level.
+*/
+
 void interrupt_handler(int i, int code)
 {
-	(interrupt_handler_table[i]) (i, code);
 	interrupt_acknowledge(i);
 	interrupt_count[i]++;
+	(interrupt_handler_table[i]) (i, code);
 }
 
 void interrupt_enable(int i)
 {
-	if(i < 32) {
+	if(i < 32 || i >= 48) {
 		/* do nothing */
 	} else {
-		pic_enable(i - 32);
+		interrupt_enabled |= 1 << (i - 32);
+		if(ioapic_mode) {
+			ioapic_enable(ioapic_pin[i - 32]);
+		} else {
+			pic_enable(i - 32);
+		}
 	}
 }
 
 void interrupt_disable(int i)
 {
-	if(i < 32) {
+	if(i < 32 || i >= 48) {
 		/* do nothing */
 	} else {
-		pic_disable(i - 32);
+		interrupt_enabled &= ~(1 << (i - 32));
+		if(ioapic_mode) {
+			ioapic_disable(ioapic_pin[i - 32]);
+		} else {
+			pic_disable(i - 32);
+		}
 	}
 }
 
+/*
+Switch hardware interrupts over to the I/O APIC, whose pins must
+already be routed to vectors 32-47.  pins gives the pin of each
+ISA interrupt.  Lines enabled at the PIC are masked there and
+enabled at the I/O APIC instead.
+*/
+
+void interrupt_use_ioapic(const int *pins)
+{
+	int i;
+
+	interrupt_block();
+	for(i = 0; i < 16; i++) {
+		pic_disable(i);
+		ioapic_pin[i] = pins[i];
+	}
+	ioapic_mode = 1;
+	for(i = 0; i < 16; i++) {
+		if(interrupt_enabled & (1 << i)) {
+			ioapic_enable(ioapic_pin[i]);
+		}
+	}
+	interrupt_unblock();
+
+	printf("interrupt: using ioapic\n");
+}
+
 void interrupt_block()
 {
 	asm("cli");
@@ -163,6 +265,7 @@ void interrupt_unblock()
 
 void interrupt_wait()
 {
-	asm("sti");
-	asm("hlt");
+	// One statement, so that hlt sits in the shadow of sti: an interrupt
+	// already pending is taken after hlt, and wakes it.
+	asm volatile("sti; hlt");
 }
@@ -13,6 +13,7 @@ void interrupt_init();
 void interrupt_register(int i, interrupt_handler_t handler);
 void interrupt_enable(int i);
 void interrupt_disable(int i);
+void interrupt_use_ioapic(const int *pins);
 void interrupt_block();
 void interrupt_unblock();
 void interrupt_wait();
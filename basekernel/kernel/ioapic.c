@@ -0,0 +1,85 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "ioapic.h"
+#include "console.h"
+
+/*
+The I/O APIC is reached through two registers: the index of an
+internal register is written to IOREGSEL, and then that register
+is read or written through IOWIN.  Each input pin has a 64-bit
+redirection entry giving the vector, trigger mode, polarity, mask,
+and destination processor of its interrupt.
+*/
+
+#define IOAPIC_REGSEL  0x00
+#define IOAPIC_WIN     0x10
+
+#define IOAPIC_VERSION  0x01
+#define IOAPIC_REDIRECT 0x10
+
+#define IOAPIC_MASKED   0x10000
+
+static volatile uint32_t *ioapic = 0;
+static int ioapic_pins = 0;
+
+static uint32_t ioapic_read(int reg)
+{
+	ioapic[IOAPIC_REGSEL / 4] = reg;
+	return ioapic[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(int reg, uint32_t value)
+{
+	ioapic[IOAPIC_REGSEL / 4] = reg;
+	ioapic[IOAPIC_WIN / 4] = value;
+}
+
+/* Start with every pin masked: each is enabled once it has a handler. */
+
+void ioapic_init(uint32_t address)
+{
+	int i;
+
+	ioapic = (volatile uint32_t *) address;
+	ioapic_pins = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xff) + 1;
+
+	for(i = 0; i < ioapic_pins; i++) {
+		ioapic_write(IOAPIC_REDIRECT + 2 * i, IOAPIC_MASKED);
+		ioapic_write(IOAPIC_REDIRECT + 2 * i + 1, 0);
+	}
+
+	printf("ioapic: %d pins at %x\n", ioapic_pins, address);
+}
+
+int ioapic_present()
+{
+	return ioapic != 0;
+}
+
+/* Send the interrupt of pin to vector on one processor, leaving it masked. */
+
+void ioapic_route(int pin, int vector, int flags, int apic_id)
+{
+	if(pin < 0 || pin >= ioapic_pins)
+		return;
+	ioapic_write(IOAPIC_REDIRECT + 2 * pin + 1, apic_id << 24);
+	ioapic_write(IOAPIC_REDIRECT + 2 * pin, IOAPIC_MASKED | flags | vector);
+}
+
+void ioapic_enable(int pin)
+{
+	if(pin < 0 || pin >= ioapic_pins)
+		return;
+	ioapic_write(IOAPIC_REDIRECT + 2 * pin, ioapic_read(IOAPIC_REDIRECT + 2 * pin) & ~IOAPIC_MASKED);
+}
+
+void ioapic_disable(int pin)
+{
+	if(pin < 0 || pin >= ioapic_pins)
+		return;
+	ioapic_write(IOAPIC_REDIRECT + 2 * pin, ioapic_read(IOAPIC_REDIRECT + 2 * pin) | IOAPIC_MASKED);
+}
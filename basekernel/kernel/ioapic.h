@@ -0,0 +1,21 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef IOAPIC_H
+#define IOAPIC_H
+
+#include "kernel/types.h"
+
+#define IOAPIC_ACTIVE_LOW 0x2000
+#define IOAPIC_LEVEL      0x8000
+
+void ioapic_init(uint32_t address);
+int  ioapic_present();
+void ioapic_route(int pin, int vector, int flags, int apic_id);
+void ioapic_enable(int pin);
+void ioapic_disable(int pin);
+
+#endif
@@ -14,6 +14,8 @@ These are C wrappers around the assembly instruction IN and OUT
 to move data to and from I/O ports.  These variants are historically
 called inb/inw/inl outb/outw/outl for in/out of byte (8 bits),
 word (16 bits), and long (32 bits) respectively.
+The string variants insw and outsw move a whole buffer of words
+through one port with a single rep instruction.
 Note that some devices requires the "slow" variants that do an
 extra dummy I/O in order to give the device more time to respond.
 */
@@ -54,6 +56,16 @@ static inline void outl(uint32_t value, int port)
       asm("outl %0, %w1": :"a"(value), "Nd"(port));
 }
 
+static inline void insw(int port, void *buffer, int count)
+{
+	asm volatile("cld; rep insw": "+D"(buffer), "+c"(count):"d"(port):"memory");
+}
+
+static inline void outsw(int port, const void *buffer, int count)
+{
+	asm volatile("cld; rep outsw": "+S"(buffer), "+c"(count):"d"(port):"memory");
+}
+
 static inline void iowait()
 {
 	outb(0, 0x80);
@@ -9,7 +9,24 @@ See the file LICENSE for details.
 #include "kernel/types.h"
 #include "memorylayout.h"
 
+/*
+Free chunks are kept on segregated lists, one per power-of-two
+size class: class k holds chunks whose length lies in
+[2^(k+KMALLOC_MIN_SHIFT), 2^(k+KMALLOC_MIN_SHIFT+1)).
+An allocation takes the head of the first non-empty class whose
+chunks are all large enough, so it never walks a long list.
+
+Every chunk carries its length both in its header and in a
+boundary tag at its very end, so that kfree can find and merge
+with the physically preceding chunk without searching for it.
+*/
+
 #define KUNIT sizeof(struct kmalloc_chunk)
+#define KTAG sizeof(int)
+
+#define KMALLOC_MIN_SHIFT 5
+#define KMALLOC_MIN_CHUNK (1 << KMALLOC_MIN_SHIFT)
+#define KMALLOC_CLASSES KMALLOC_STATS_CLASSES
 
 #define KMALLOC_STATE_FREE 0xa1a1a1a1
 #define KMALLOC_STATE_USED 0xbfbfbfbf
@@ -22,26 +39,98 @@ struct kmalloc_chunk {
     struct kmalloc_chunk *prev;
 };
 
-static struct kmalloc_chunk *head = 0;
+static char *arena_start = 0;
+static char *arena_end = 0;
+static struct kmalloc_chunk *free_lists[KMALLOC_CLASSES];
+static struct kmalloc_stats stats = {0};
+
+static int kmalloc_class(int length) {
+    int k = 0;
+    length >>= KMALLOC_MIN_SHIFT;
+    while (length > 1 && k < KMALLOC_CLASSES - 1) {
+        length >>= 1;
+        k++;
+    }
+    return k;
+}
+
+static void kmalloc_set_tag(struct kmalloc_chunk *c) {
+    *(int *)((char *)c + c->length - KTAG) = c->length;
+}
+
+static void kmalloc_insert(struct kmalloc_chunk *c) {
+    int k = kmalloc_class(c->length);
+    c->state = KMALLOC_STATE_FREE;
+    c->prev = 0;
+    c->next = free_lists[k];
+    if (c->next) {
+        c->next->prev = c;
+    }
+    free_lists[k] = c;
+    kmalloc_set_tag(c);
+    stats.class_free[k]++;
+}
+
+static void kmalloc_remove(struct kmalloc_chunk *c) {
+    int k = kmalloc_class(c->length);
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        free_lists[k] = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+    c->next = c->prev = 0;
+    stats.class_free[k]--;
+}
 
 void kmalloc_init(char *start, int length) {
-    head = (struct kmalloc_chunk *)start;
-    head->state = KMALLOC_STATE_FREE;
-    head->length = length;
-    head->next = 0;
-    head->prev = 0;
+    int k;
+    for (k = 0; k < KMALLOC_CLASSES; k++) {
+        free_lists[k] = 0;
+    }
+
+    arena_start = start;
+    arena_end = start + (length & ~(KUNIT - 1));
+    stats.bytes_total = arena_end - arena_start;
+
+    struct kmalloc_chunk *c = (struct kmalloc_chunk *)start;
+    c->length = stats.bytes_total;
+    kmalloc_insert(c);
 }
 
 void *kmalloc(int length) {
-    length = (length + KUNIT - 1) & ~(KUNIT - 1); 
-    length += KUNIT; 
+    length = (length + KUNIT + KTAG + KUNIT - 1) & ~(KUNIT - 1);
+    if (length < KMALLOC_MIN_CHUNK) {
+        length = KMALLOC_MIN_CHUNK;
+    }
+
+    /*
+    Any chunk in a class above that of length is large enough.
+    The class of length itself is only good enough without looking
+    when length is exactly the lower bound of that class.
+    */
 
-    struct kmalloc_chunk *c = head;
-    while (c) {
-        if (c->state == KMALLOC_STATE_FREE && c->length >= length) {
+    struct kmalloc_chunk *c = 0;
+    int k = kmalloc_class(length);
+    if (length != (KMALLOC_MIN_CHUNK << k)) {
+        k++;
+    }
+    for (; k < KMALLOC_CLASSES; k++) {
+        if (free_lists[k]) {
+            c = free_lists[k];
             break;
         }
-        c = c->next;
+    }
+
+    if (!c) {
+        // Last resort: search the class of length itself.
+        for (c = free_lists[kmalloc_class(length)]; c; c = c->next) {
+            if (c->length >= length) {
+                break;
+            }
+        }
     }
 
     if (!c) {
@@ -49,62 +138,95 @@ void *kmalloc(int length) {
         return 0;
     }
 
-    if (c->length - length > 2 * KUNIT) {
+    kmalloc_remove(c);
+
+    if (c->length - length >= KMALLOC_MIN_CHUNK) {
         struct kmalloc_chunk *n = (struct kmalloc_chunk *)((char *)c + length);
-        n->state = KMALLOC_STATE_FREE; 
         n->length = c->length - length;
-        n->prev = c;
-        n->next = c->next;
-        if (c->next) {
-            c->next->prev = n;
-        }
-        c->next = n;
+        kmalloc_insert(n);
         c->length = length;
     }
 
-    c->state = KMALLOC_STATE_USED; 
+    c->state = KMALLOC_STATE_USED;
+    kmalloc_set_tag(c);
+
+    stats.bytes_in_use += c->length;
+    stats.class_used[kmalloc_class(c->length)]++;
+
     return (c + 1);
 }
 
 void kfree(void *ptr) {
     struct kmalloc_chunk *c = (struct kmalloc_chunk *)ptr - 1;
-    if (c->state != KMALLOC_STATE_USED) {
+    if ((char *)c < arena_start || (char *)c >= arena_end || c->state != KMALLOC_STATE_USED) {
         printf("invalid kfree(%x)\n", ptr);
         return;
     }
 
-    c->state = KMALLOC_STATE_FREE; 
+    stats.bytes_in_use -= c->length;
+    stats.class_used[kmalloc_class(c->length)]--;
+
+    struct kmalloc_chunk *n = (struct kmalloc_chunk *)((char *)c + c->length);
+    if ((char *)n < arena_end && n->state == KMALLOC_STATE_FREE) {
+        kmalloc_remove(n);
+        c->length += n->length;
+    }
 
-    if (c->next && c->next->state == KMALLOC_STATE_FREE) {
-        c->length += c->next->length;
-        c->next = c->next->next;
-        if (c->next) {
-            c->next->prev = c;
+    if ((char *)c > arena_start) {
+        int plength = *(int *)((char *)c - KTAG);
+        struct kmalloc_chunk *p = (struct kmalloc_chunk *)((char *)c - plength);
+        if (p->state == KMALLOC_STATE_FREE && p->length == plength) {
+            kmalloc_remove(p);
+            p->length += c->length;
+            c = p;
         }
     }
 
-    if (c->prev && c->prev->state == KMALLOC_STATE_FREE) {
-        c->prev->length += c->length;
-        c->prev->next = c->next;
-        if (c->next) {
-            c->next->prev = c->prev;
+    kmalloc_insert(c);
+}
+
+void kmalloc_stats(struct kmalloc_stats *s) {
+    int k;
+
+    stats.largest_free = 0;
+    for (k = KMALLOC_CLASSES - 1; k >= 0; k--) {
+        if (free_lists[k]) {
+            struct kmalloc_chunk *c;
+            for (c = free_lists[k]; c; c = c->next) {
+                if (c->length > stats.largest_free) {
+                    stats.largest_free = c->length;
+                }
+            }
+            break;
         }
-        c = c->prev;
     }
+
+    *s = stats;
 }
 
 void kmalloc_debug() {
     struct kmalloc_chunk *c;
-    printf("state ptr      prev     next     length\n");
-    for (c = head; c; c = c->next) {
+    int k;
+
+    printf("state ptr      next     prev     length\n");
+    for (c = (struct kmalloc_chunk *)arena_start; (char *)c < arena_end; c = (struct kmalloc_chunk *)((char *)c + c->length)) {
         if (c->state == KMALLOC_STATE_FREE) {
             printf("F");
         } else if (c->state == KMALLOC_STATE_USED) {
             printf("U");
         } else {
-            printf("kmalloc list corrupted at %x!\n", c);
+            printf("kmalloc arena corrupted at %x!\n", c);
+            return;
+        }
+        printf("     %x %x %x %d\n", c, c->next, c->prev, c->length);
+        if (c->length <= 0 || *(int *)((char *)c + c->length - KTAG) != c->length) {
+            printf("kmalloc boundary tag corrupted at %x!\n", c);
             return;
         }
-        printf("     %x %x %x %d\n", c, c->prev, c->next, c->length);
+    }
+
+    printf("class size     free used\n");
+    for (k = 0; k < KMALLOC_CLASSES; k++) {
+        printf("%d     %d %d %d\n", k, KMALLOC_MIN_CHUNK << k, stats.class_free[k], stats.class_used[k]);
     }
 }
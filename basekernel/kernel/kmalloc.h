@@ -23,6 +23,8 @@
 #ifndef KMALLOC_H
 #define KMALLOC_H
 
+#include "kernel/stats.h"
+
 /**
  * @brief Allocates memory in the kernel space
  *
@@ -54,6 +56,17 @@ void kfree(void *ptr);
  */
 void kmalloc_init(char *start, int length);
 
+/**
+ * @brief Reports the state of the kernel memory allocator
+ *
+ * The kmalloc_stats() function fills in the number of bytes in use, the
+ * number of free and allocated chunks in each size class, and the length
+ * of the largest free chunk.
+ *
+ * @param s is the structure to be filled in
+ */
+void kmalloc_stats(struct kmalloc_stats *s);
+
 /**
  * @brief Outputs debugging information for the kernel memory allocator
  *
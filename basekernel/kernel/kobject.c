@@ -7,6 +7,7 @@
 #include "console.h"
 #include "kobject.h"
 #include "kmalloc.h"
+#include "slab.h"
 #include "string.h"
 
 #include "device.h"
@@ -17,9 +18,11 @@
 
 #include "kernel/error.h"
 
+static struct kmem_cache kobject_cache = KMEM_CACHE_INIT("kobject", sizeof(struct kobject));
+
 static struct kobject *kobject_create()
 {
-	struct kobject *k = kmalloc(sizeof(*k));
+	struct kobject *k = kmem_cache_alloc(&kobject_cache);
 	k->refcount = 1;
 	k->offset = 0;
 	k->tag = 0;
@@ -328,7 +331,7 @@ int kobject_close(struct kobject *kobject)
 		}
 		if (kobject->tag)
 			kfree(kobject->tag);
-		kfree(kobject);
+		kmem_cache_free(&kobject_cache, kobject);
 		return 0;
 	} else if(kobject->refcount>1 ) {
 		if(kobject->type==KOBJECT_PIPE) {
@@ -20,6 +20,7 @@ See the file LICENSE for details.
 #include "clock.h"
 #include "kernelcore.h"
 #include "bcache.h"
+#include "pagecache.h"
 #include "printf.h"
 #include "keymap.h"
 
@@ -377,10 +378,54 @@ static int kshell_execute(int argc, const char **argv)
 			stats.read_hits,stats.read_misses,
 			stats.write_hits,stats.write_misses,
 			stats.writebacks);
+		printf("%d blocks of %d, at most %d so far, %d evicted\n",
+			stats.size,stats.limit,
+			stats.high_watermark,stats.evictions);
+		printf("%d rahit %d ramiss\n",
+			stats.readahead_hits,stats.readahead_misses);
+	} else if(!strcmp(cmd, "bcache_size")) {
+		int blocks;
+		if(argc > 1 && str2int(argv[1], &blocks)) {
+			printf("bcache: up to %d blocks\n", bcache_set_size(blocks));
+		} else {
+			printf("bcache_size: requires number of blocks\n");
+		}
+	} else if(!strcmp(cmd, "mem_stats")) {
+		uint32_t nfree, ntotal, nlargest;
+		page_stats(&nfree, &ntotal, &nlargest);
+		printf("%d free %d total %d largest block (pages)\n", nfree, ntotal, nlargest);
+	} else if(!strcmp(cmd, "kmalloc_stats")) {
+		struct kmalloc_stats stats;
+		kmalloc_stats(&stats);
+		printf("%d used %d total %d largest free (bytes)\n", stats.bytes_in_use, stats.bytes_total, stats.largest_free);
+		int i;
+		for(i = 0; i < KMALLOC_STATS_CLASSES; i++) {
+			if(stats.class_free[i] || stats.class_used[i]) {
+				printf("class %d: %d free %d used\n", i, stats.class_free[i], stats.class_used[i]);
+			}
+		}
+	} else if(!strcmp(cmd, "pagecache_stats")) {
+		pagecache_debug();
+	} else if(!strcmp(cmd, "nice")) {
+		int pid, priority;
+		if(argc > 2 && str2int(argv[1], &pid) && str2int(argv[2], &priority)) {
+			if(process_set_priority(pid, priority) < 0) {
+				printf("nice: couldn't set priority of process %d to %d (0 is highest, %d lowest)\n", pid, priority, PROCESS_PRIORITY_LEVELS - 1);
+			}
+		} else {
+			printf("nice: requires process id and priority\n");
+		}
+	} else if(!strcmp(cmd, "quantum")) {
+		int ticks;
+		if(argc > 1 && str2int(argv[1], &ticks)) {
+			process_quantum_set(ticks);
+		} else {
+			printf("quantum: requires number of clock ticks\n");
+		}
 	} else if(!strcmp(cmd,"bcache_flush")) {
 		bcache_flush_all();
 	} else if(!strcmp(cmd, "help")) {
-		printf("Kernel Shell Commands:\nrun <path> <args>\nstart <path> <args>\nprocess_show\nkb_layout <args>\ninit\nkill <pid>\nreap <pid>\nwait\nlist\nautomount\nmount <device> <unit> <fstype>\numount\nformat <device> <unit><fstype>\ninstall atapi <srcunit> ata <dstunit>\nmkdir <path>\nremove <path>time\nbcache_stats\nbcache_flush\nreboot\nhelp\n\n");
+		printf("Kernel Shell Commands:\nrun <path> <args>\nstart <path> <args>\nprocess_show\nkb_layout <args>\ninit\nkill <pid>\nreap <pid>\nwait\nlist\nautomount\nmount <device> <unit> <fstype>\numount\nformat <device> <unit><fstype>\ninstall atapi <srcunit> ata <dstunit>\nmkdir <path>\nremove <path>time\nmem_stats\nkmalloc_stats\nbcache_stats\nbcache_size <blocks>\nbcache_flush\npagecache_stats\nnice <pid> <priority>\nquantum <ticks>\nreboot\nhelp\n\n");
 	} else {
 		printf("%s: command not found\n", argv[0]);
 	}
@@ -109,8 +109,8 @@ void list_remove(struct list_node *node)
 	node->next->prev = node->prev;
 	node->prev->next = node->next;
 	node->next = node->prev = 0;
-	node->list = 0;
 	node->list->size--;
+	node->list = 0;
 }
 
 int list_size( struct list *list )
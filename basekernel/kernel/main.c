@@ -26,6 +26,8 @@ See the file LICENSE for details.
 #include "cdromfs.h"
 #include "diskfs.h"
 #include "serial.h"
+#include "smp.h"
+#include "bcache.h"
 
 /*
 This is the C initialization point of the kernel.
@@ -36,6 +38,8 @@ Now we initialize each subsystem in the proper order:
 
 int kernel_main()
 {
+	smp_boot_init();
+
 	struct console *console = console_create_root();
 	console_addref(console);
 
@@ -52,6 +56,8 @@ int kernel_main()
 	rtc_init();
 	clock_init();
 	process_init();
+	smp_init();
+	bcache_init();
 	ata_init();
 	cdrom_init();
 	diskfs_init();
@@ -78,3 +78,14 @@ grow down.  Addresses below 0x80000000 are all supervisor mode.
 
 #define PROCESS_ENTRY_POINT 0x80000000
 #define PROCESS_STACK_INIT  0xfffffff0
+
+/*
+Processors other than the first start in real mode at
+SMP_TRAMPOLINE, where smp_init copies the startup code.
+The I/O APIC and local APIC registers lie in the 4MB at
+APIC_REGION_START, which is mapped like the video buffer
+into every address space.
+*/
+
+#define SMP_TRAMPOLINE    0x1000
+#define APIC_REGION_START 0xfec00000
@@ -8,21 +8,33 @@ See the file LICENSE for details.
 #include "interrupt.h"
 #include "process.h"
 
+/*
+The waiter drops the spinlock before it blocks, because the processor
+that wakes it must take the spinlock too.  A wakeup can not slip in
+between the two, since process_wait runs under the kernel lock.
+*/
+
 void mutex_lock(struct mutex *m)
 {
 	interrupt_block();
+	spinlock_acquire(&m->lock);
 	while(m->locked) {
+		spinlock_release(&m->lock);
 		process_wait(&m->waitqueue);
 		interrupt_block();
+		spinlock_acquire(&m->lock);
 	}
 	m->locked = 1;
+	spinlock_release(&m->lock);
 	interrupt_unblock();
 }
 
 void mutex_unlock(struct mutex *m)
 {
 	interrupt_block();
+	spinlock_acquire(&m->lock);
 	m->locked = 0;
 	process_wakeup(&m->waitqueue);
+	spinlock_release(&m->lock);
 	interrupt_unblock();
 }
@@ -8,13 +8,20 @@ See the file LICENSE for details.
 #define MUTEX_H
 
 #include "list.h"
+#include "spinlock.h"
+
+/*
+A mutex is held across sleeps.  Its spinlock guards only the
+locked flag and the wait queue, and is held with interrupts blocked.
+*/
 
 struct mutex {
 	int locked;
 	struct list waitqueue;
+	struct spinlock lock;
 };
 
-#define MUTEX_INIT {0,LIST_INIT}
+#define MUTEX_INIT {0,LIST_INIT,SPINLOCK_INIT}
 
 void mutex_lock(struct mutex *m);
 void mutex_unlock(struct mutex *m);
@@ -8,100 +8,320 @@ See the file LICENSE for details.
 #include "kernel/types.h"
 #include "page.h"
 #include "string.h"
+#include "list.h"
 #include "memorylayout.h"
 #include "kernelcore.h"
 
+/*
+Physical pages are managed by a binary buddy allocator.
+A free block of order k is 2^k contiguous pages whose page
+number (relative to main_memory_start) is a multiple of 2^k.
+Each order has its own free list, and the list node is stored
+in the first bytes of the free block itself, so no extra memory
+is needed beyond one info byte per page, which records whether
+the page heads a free block, an allocated block, or neither.
+
+Single pages may also be shared, for example between a parent
+and child after fork.  page_refs counts the references held
+beyond the first, and page_free only releases the page once
+that count has dropped to zero.
+
+Clearing a page is the main cost of page_alloc(1), so a small
+pool of pages is cleared ahead of time, when the scheduler has
+nothing else to do.  These pages stay allocated from the point
+of view of the buddy allocator, and are handed back to it if a
+block cannot otherwise be found.
+*/
+
+#define PAGE_ZERO_POOL_MAX 64
+
+#define PAGE_INFO_FREE  0x80
+#define PAGE_INFO_USED  0x40
+#define PAGE_INFO_ORDER 0x0f
+
 static uint32_t pages_free = 0;
 static uint32_t pages_total = 0;
 
-static uint32_t *freemap = 0;
-static uint32_t freemap_bits = 0;
-static uint32_t freemap_bytes = 0;
-static uint32_t freemap_cells = 0;
-static uint32_t freemap_pages = 0;
+static uint8_t *page_info = 0;
+static uint32_t page_info_pages = 0;
+static uint16_t *page_refs = 0;
+
+static struct list free_lists[PAGE_MAX_ORDER + 1];
+static struct list zero_pool = LIST_INIT;
 
 static void *main_memory_start = (void *) MAIN_MEMORY_START;
 
-#define CELL_BITS (8*sizeof(*freemap))
+/*
+Caches that can give pages back register a reclaim function.
+When free pages, counting the pre-zeroed pool, run below
+PAGE_RECLAIM_LOW, page_alloc asks them to release a batch of what
+they can drop at once, without I/O, since the caller may be any
+allocation at all.  Only when no page is left does it ask again,
+urgently, and the caches may then write back to make room, rather
+than halting while memory is merely held by a cache.
+*/
+
+#define PAGE_RECLAIMERS 4
+#define PAGE_RECLAIM_LOW 64
+#define PAGE_RECLAIM_BATCH 32
+
+static page_reclaim_t reclaimers[PAGE_RECLAIMERS];
+static int reclaimer_count = 0;
+static int reclaiming = 0;
+
+static inline uint32_t page_number(void *addr)
+{
+	return (addr - main_memory_start) >> PAGE_BITS;
+}
+
+static inline void *page_address(uint32_t pagenumber)
+{
+	return (pagenumber << PAGE_BITS) + main_memory_start;
+}
+
+static void page_block_insert(uint32_t pagenumber, int order)
+{
+	page_info[pagenumber] = PAGE_INFO_FREE | order;
+	list_push_head(&free_lists[order], page_address(pagenumber));
+}
+
+static void page_block_remove(uint32_t pagenumber)
+{
+	page_info[pagenumber] = 0;
+	list_remove(page_address(pagenumber));
+}
 
 void page_init()
 {
-	int i;
+	uint32_t i;
+	int order;
 
 	pages_total = (total_memory * 1024 * 1024 - MAIN_MEMORY_START) / PAGE_SIZE;
-	pages_free = pages_total;
-	printf("memory: %d MB (%d KB) total\n", (pages_free * PAGE_SIZE) / MEGA, (pages_free * PAGE_SIZE) / KILO);
-
-	freemap = main_memory_start;
-	freemap_bits = pages_total;
-	freemap_bytes = 1 + freemap_bits / 8;
-	freemap_cells = 1 + freemap_bits / CELL_BITS;
-	freemap_pages = 1 + freemap_bytes / PAGE_SIZE;
+	printf("memory: %d MB (%d KB) total\n", (pages_total * PAGE_SIZE) / MEGA, (pages_total * PAGE_SIZE) / KILO);
 
-	printf("memory: %d bits %d bytes %d cells %d pages\n", freemap_bits, freemap_bytes, freemap_cells, freemap_pages);
+	page_info = main_memory_start;
+	page_refs = (uint16_t *) (page_info + pages_total + (pages_total & 1));
+	page_info_pages = 1 + (pages_total * 3 + 1) / PAGE_SIZE;
+	memset(page_info, 0, page_info_pages * PAGE_SIZE);
 
-	memset(freemap, 0xff, freemap_bytes);
-	for(i = 0; i < freemap_pages; i++)
-		page_alloc(0);
+	printf("memory: %d pages %d info pages %d orders\n", pages_total, page_info_pages, PAGE_MAX_ORDER + 1);
 
 	// This is ahack that I don't understand yet.
 	// vmware doesn't like the use of a particular page
 	// close to 1MB, but what it is used for I don't know.
+	// So, the first 32 pages are never handed out,
+	// in addition to those holding the page info.
+
+	i = MAX(page_info_pages, 32);
 
-	freemap[0] = 0x0;
+	// Carve the remaining pages into the largest aligned blocks that fit.
+
+	while(i < pages_total) {
+		order = PAGE_MAX_ORDER;
+		while(order > 0 && ((i & ((1 << order) - 1)) || i + (1 << order) > pages_total)) {
+			order--;
+		}
+		page_block_insert(i, order);
+		pages_free += 1 << order;
+		i += 1 << order;
+	}
 
 	printf("memory: %d MB (%d KB) available\n", (pages_free * PAGE_SIZE) / MEGA, (pages_free * PAGE_SIZE) / KILO);
 }
 
-void page_stats( uint32_t *nfree, uint32_t *ntotal )
+void page_stats( uint32_t *nfree, uint32_t *ntotal, uint32_t *nlargest )
 {
-	*nfree = pages_free;
-	*ntotal = pages_total;
+	int order;
+
+	if(nfree) *nfree = pages_free + list_size(&zero_pool);
+	if(ntotal) *ntotal = pages_total;
+
+	if(nlargest) {
+		*nlargest = 0;
+		for(order = PAGE_MAX_ORDER; order >= 0; order--) {
+			if(free_lists[order].head) {
+				*nlargest = 1 << order;
+				break;
+			}
+		}
+	}
 }
 
-void *page_alloc(bool zeroit)
+void *page_alloc_contig(int order)
 {
-	uint32_t i, j;
-	uint32_t cellmask;
+	struct list_node *n;
 	uint32_t pagenumber;
-	void *pageaddr;
+	int o;
 
-	if(!freemap) {
+	if(!page_info) {
 		printf("memory: not initialized yet!\n");
 		return 0;
 	}
 
-	for(i = 0; i < freemap_cells; i++) {
-		if(freemap[i] != 0) {
-			for(j = 0; j < CELL_BITS; j++) {
-				cellmask = (1 << j);
-				if(freemap[i] & cellmask) {
-					freemap[i] &= ~cellmask;
-					pagenumber = i * CELL_BITS + j;
-					pageaddr = (pagenumber << PAGE_BITS) + main_memory_start;
-					if(zeroit)
-						memset(pageaddr, 0, PAGE_SIZE);
-					pages_free--;
-					//printf("page: alloc %d\n",pages_free);
-					return pageaddr;
-				}
-			}
+	if(order < 0 || order > PAGE_MAX_ORDER)
+		return 0;
+
+	for(o = order; o <= PAGE_MAX_ORDER; o++) {
+		if(free_lists[o].head)
+			break;
+	}
+
+	if(o > PAGE_MAX_ORDER) {
+		if(!zero_pool.head)
+			return 0;
+		// Give the pre-cleared pages back, and try again.
+		while((n = list_pop_head(&zero_pool))) {
+			page_free(n);
 		}
+		return page_alloc_contig(order);
+	}
+
+	n = list_pop_head(&free_lists[o]);
+	pagenumber = page_number(n);
+
+	// Split the block in half until it is the right size,
+	// returning the upper half of each split to the free lists.
+
+	while(o > order) {
+		o--;
+		page_block_insert(pagenumber + (1 << o), o);
 	}
 
-	printf("memory: WARNING: everything allocated\n");
-	halt();
+	page_info[pagenumber] = PAGE_INFO_USED | order;
+	pages_free -= 1 << order;
 
-	return 0;
+	return page_address(pagenumber);
+}
+
+static void *page_zero_take()
+{
+	void *pageaddr = list_pop_head(&zero_pool);
+	if(pageaddr)
+		memset(pageaddr, 0, sizeof(struct list_node));
+	return pageaddr;
+}
+
+int page_zero_refill()
+{
+	if(list_size(&zero_pool) >= PAGE_ZERO_POOL_MAX || pages_free < 2 * PAGE_ZERO_POOL_MAX)
+		return 0;
+
+	void *pageaddr = page_alloc_contig(0);
+	if(!pageaddr)
+		return 0;
+
+	memset(pageaddr, 0, PAGE_SIZE);
+	list_push_head(&zero_pool, pageaddr);
+	return 1;
+}
+
+void page_reclaim_register(page_reclaim_t reclaim)
+{
+	if(reclaimer_count < PAGE_RECLAIMERS)
+		reclaimers[reclaimer_count++] = reclaim;
+}
+
+static int page_reclaim(int pages, int urgent)
+{
+	int i, freed = 0;
+
+	// A reclaimer that allocates must not set off another round.
+	if(reclaiming)
+		return 0;
+
+	reclaiming = 1;
+	for(i = 0; i < reclaimer_count && freed < pages; i++) {
+		freed += reclaimers[i](pages - freed, urgent);
+	}
+	reclaiming = 0;
+
+	return freed;
+}
+
+void *page_alloc(bool zeroit)
+{
+	void *pageaddr;
+
+	if(pages_free + list_size(&zero_pool) < PAGE_RECLAIM_LOW)
+		page_reclaim(PAGE_RECLAIM_BATCH, 0);
+
+	if(zeroit) {
+		pageaddr = page_zero_take();
+		if(pageaddr)
+			return pageaddr;
+	}
+
+	pageaddr = page_alloc_contig(0);
+	if(!pageaddr && page_reclaim(1, 1))
+		pageaddr = page_alloc_contig(0);
+	if(!pageaddr) {
+		if(page_info) {
+			printf("memory: WARNING: everything allocated\n");
+			halt();
+		}
+		return 0;
+	}
+
+	if(zeroit)
+		memset(pageaddr, 0, PAGE_SIZE);
+
+	//printf("page: alloc %d\n",pages_free);
+	return pageaddr;
 }
 
 void page_free(void *pageaddr)
 {
-	uint32_t pagenumber = (pageaddr - main_memory_start) >> PAGE_BITS;
-	uint32_t cellnumber = pagenumber / CELL_BITS;
-	uint32_t celloffset = pagenumber % CELL_BITS;
-	uint32_t cellmask = (1 << celloffset);
-	freemap[cellnumber] |= cellmask;
-	pages_free++;
+	uint32_t pagenumber = page_number(pageaddr);
+	uint32_t buddy;
+	int order;
+
+	if(pagenumber >= pages_total || !(page_info[pagenumber] & PAGE_INFO_USED)) {
+		printf("memory: invalid page_free(%x)\n", pageaddr);
+		return;
+	}
+
+	if(page_refs[pagenumber] > 0) {
+		page_refs[pagenumber]--;
+		return;
+	}
+
+	order = page_info[pagenumber] & PAGE_INFO_ORDER;
+	page_info[pagenumber] = 0;
+	pages_free += 1 << order;
+
+	// Merge with the buddy block as long as it is entirely free.
+
+	while(order < PAGE_MAX_ORDER) {
+		buddy = pagenumber ^ (1 << order);
+		if(buddy >= pages_total || page_info[buddy] != (PAGE_INFO_FREE | order))
+			break;
+		page_block_remove(buddy);
+		pagenumber = MIN(pagenumber, buddy);
+		order++;
+	}
+
+	page_block_insert(pagenumber, order);
 	//printf("page: free %d\n",pages_free);
 }
+
+void page_addref(void *pageaddr)
+{
+	uint32_t pagenumber = page_number(pageaddr);
+
+	if(pagenumber >= pages_total || !(page_info[pagenumber] & PAGE_INFO_USED)) {
+		printf("memory: invalid page_addref(%x)\n", pageaddr);
+		return;
+	}
+
+	page_refs[pagenumber]++;
+}
+
+int page_refcount(void *pageaddr)
+{
+	uint32_t pagenumber = page_number(pageaddr);
+
+	if(pagenumber >= pages_total || !(page_info[pagenumber] & PAGE_INFO_USED))
+		return 0;
+
+	return page_refs[pagenumber] + 1;
+}
@@ -24,6 +24,8 @@
 
 #include "kernel/types.h"
 
+#define PAGE_MAX_ORDER 10 // largest block is 2^10 pages (4 MB)
+
 void  page_init(); //initializes the page management system
 /********************************************************************************************
  * @brief initializes the page management system
@@ -47,26 +49,96 @@ void *page_alloc(bool zeroit); //allocates a new page of memory
  * 
  ********************************************************************************************/
 
+void *page_alloc_contig(int order); //allocates 2^order physically contiguous pages
+/********************************************************************************************
+ * @brief Allocates a block of physically contiguous pages
+ *
+ * The page_alloc_contig() function takes a block of 2^order pages from the buddy allocator,
+ * splitting a larger free block if necessary. The block is aligned on its own size relative
+ * to the start of main memory. Unlike page_alloc(), it does not clear the block and does
+ * not halt when memory is exhausted, since large blocks may be unavailable due to
+ * fragmentation even when plenty of single pages remain.
+ *
+ * @param  order is the base-2 logarithm of the number of pages, from 0 to PAGE_MAX_ORDER.
+ *
+ * @return a pointer to the first page of the block, or zero if no block is available.
+ *
+ ********************************************************************************************/
+
+typedef int (*page_reclaim_t)(int pages, int urgent);
+
+void  page_reclaim_register(page_reclaim_t reclaim); //adds a cache that can give pages back under pressure
+/********************************************************************************************
+ * @brief adds a cache that can give pages back under pressure
+ *
+ * The page_reclaim_register() function records a function that page_alloc() calls when free
+ * pages run low, or have run out, with the number of pages it would like back. The function
+ * releases what it can with page_free(), and returns the number of pages it released.
+ * Only when pages have run out is urgent set, and may the function wait for I/O to free them;
+ * otherwise it releases what it can at once, and may arrange for more to be freed later.
+ *
+ * @param reclaim is the function to call.
+ *
+ ********************************************************************************************/
+
+int   page_zero_refill(); //clears one more page for the pool used by page_alloc(1)
+/********************************************************************************************
+ * @brief clears one more page for the pool used by page_alloc(1)
+ *
+ * The page_zero_refill() function takes one free page, clears it, and adds it to a small pool
+ * of cleared pages, from which page_alloc(1) is served without clearing on the spot. It is
+ * meant to be called when there is nothing better to do, such as from the idle loop.
+ *
+ * @return one if a page was added to the pool, or zero if the pool is full or memory is low.
+ *
+ ********************************************************************************************/
+
 void  page_free(void *addr); //frees a previously allocated page of memory
 /********************************************************************************************
  * @brief frees a previously allocated page of memory
  *
- * The page_free() function frees a previously allocated memory page, updating page allocation 
- * statistics and making the page available for future allocations.
+ * The page_free() function frees a block previously returned by page_alloc() or
+ * page_alloc_contig(), updating page allocation statistics and merging the block with its
+ * free buddies so that contiguous runs become available again.
  * 
- * @param addr is the address of the page to be freed.
+ * @param addr is the address of the page (or first page of the block) to be freed.
  * 
  ********************************************************************************************/
 
-void  page_stats( uint32_t *nfree, uint32_t *ntotal ); //takes statistics about the page management system
+void  page_addref(void *addr); //adds a reference to an allocated page
+/********************************************************************************************
+ * @brief adds a reference to an allocated page
+ *
+ * The page_addref() function records one more owner of a page that is shared, for example
+ * between the address spaces of a parent and child after fork. Each reference is dropped
+ * by one call to page_free(), and the page is only released when the last one is dropped.
+ *
+ * @param addr is the address of the page.
+ *
+ ********************************************************************************************/
+
+int   page_refcount(void *addr); //returns the number of references to an allocated page
+/********************************************************************************************
+ * @brief returns the number of references to an allocated page
+ *
+ * @param addr is the address of the page.
+ *
+ * @return the number of owners of the page, or zero if it is not allocated.
+ *
+ ********************************************************************************************/
+
+void  page_stats( uint32_t *nfree, uint32_t *ntotal, uint32_t *nlargest ); //takes statistics about the page management system
 /********************************************************************************************
  * @brief takes statistics about the page management system
  *
  * The page_stats() function returns statistics about the current state of the page allocator, such as 
- * the number of free pages, the number of allocated pages, and the total number of pages.
+ * the number of free pages, the total number of pages, and the size of the largest free block.
+ * The gap between the number of free pages and the largest free block indicates fragmentation.
+ * Any of the pointers may be null if that value is not wanted.
  * 
  * @param  nfree is a pointer to uint32_t variable that will hold the number of free pages.
  * @param  ntotal is a pointer to uint32_t variable that will hold the number of pages.
+ * @param  nlargest is a pointer to uint32_t variable that will hold the number of pages in the largest free block.
 
  ********************************************************************************************/
 
@@ -0,0 +1,174 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "pagecache.h"
+#include "fs_internal.h"
+#include "list.h"
+#include "page.h"
+#include "slab.h"
+#include "string.h"
+#include "console.h"
+
+/*
+Each entry holds one reference to its page, and every process
+that maps the page holds another.  Entries are kept in LRU order
+on one list, and chained by key in a small hash table.  Once the
+cache grows beyond its limit, the least recently used entries
+that no process is mapping are released.
+*/
+
+#define PAGECACHE_BUCKETS 64
+#define PAGECACHE_MAX_PAGES 256
+
+struct pagecache_entry {
+	struct list_node node;
+	struct pagecache_entry *hash_next;
+	struct fs_volume *volume;
+	int inumber;
+	uint32_t offset;
+	void *page;
+};
+
+static struct kmem_cache pagecache_entry_cache = KMEM_CACHE_INIT("pagecache_entry", sizeof(struct pagecache_entry));
+static struct list lru = LIST_INIT;
+static struct pagecache_entry *buckets[PAGECACHE_BUCKETS] = {0};
+static int hits = 0;
+static int misses = 0;
+
+static struct pagecache_entry **pagecache_bucket( struct fs_volume *v, int inumber, uint32_t offset )
+{
+	uint32_t h = (uint32_t) v / sizeof(struct fs_volume) + inumber * 31 + offset / PAGE_SIZE;
+	return &buckets[h % PAGECACHE_BUCKETS];
+}
+
+static void pagecache_entry_delete( struct pagecache_entry *e )
+{
+	struct pagecache_entry **p = pagecache_bucket(e->volume, e->inumber, e->offset);
+
+	while(*p != e) p = &(*p)->hash_next;
+	*p = e->hash_next;
+
+	list_remove(&e->node);
+	page_free(e->page);
+	kmem_cache_free(&pagecache_entry_cache, e);
+}
+
+static void pagecache_trim()
+{
+	struct pagecache_entry *e = (struct pagecache_entry *) lru.tail;
+
+	while(e && list_size(&lru) > PAGECACHE_MAX_PAGES) {
+		struct pagecache_entry *prev = (struct pagecache_entry *) e->node.prev;
+		if(page_refcount(e->page) == 1) {
+			pagecache_entry_delete(e);
+		}
+		e = prev;
+	}
+}
+
+/* Returns the cached page with a reference for the caller, or null. */
+
+static void *pagecache_find( struct fs_dirent *d, uint32_t offset )
+{
+	struct pagecache_entry *e;
+
+	for(e = *pagecache_bucket(d->volume, d->inumber, offset); e; e = e->hash_next) {
+		if(e->volume == d->volume && e->inumber == d->inumber && e->offset == offset) {
+			list_remove(&e->node);
+			list_push_head(&lru, &e->node);
+			page_addref(e->page);
+			return e->page;
+		}
+	}
+
+	return 0;
+}
+
+void *pagecache_get( struct fs_dirent *d, uint32_t offset )
+{
+	struct pagecache_entry **b;
+	struct pagecache_entry *e;
+	char *cached = pagecache_find(d, offset);
+
+	if(cached) {
+		hits++;
+		return cached;
+	}
+
+	misses++;
+
+	if(offset >= d->size) return 0;
+	uint32_t length = MIN(PAGE_SIZE, d->size - offset);
+
+	char *page = page_alloc(0);
+	if(!page) return 0;
+
+	if(fs_dirent_read(d, page, length, offset) != length) {
+		page_free(page);
+		return 0;
+	}
+	memset(page + length, 0, PAGE_SIZE - length);
+
+	// The read may yield, and another process may have cached the same page meanwhile.
+	cached = pagecache_find(d, offset);
+	if(cached) {
+		page_free(page);
+		return cached;
+	}
+
+	e = kmem_cache_alloc(&pagecache_entry_cache);
+	if(!e) {
+		// Not cached, but still usable by the caller.
+		return page;
+	}
+
+	e->volume = d->volume;
+	e->inumber = d->inumber;
+	e->offset = offset;
+	e->page = page;
+	b = pagecache_bucket(d->volume, d->inumber, offset);
+	e->hash_next = *b;
+	*b = e;
+	list_push_head(&lru, &e->node);
+
+	// One reference for the cache, and one for the caller.
+	page_addref(page);
+
+	pagecache_trim();
+
+	return page;
+}
+
+void pagecache_invalidate( struct fs_dirent *d )
+{
+	struct pagecache_entry *e = (struct pagecache_entry *) lru.head;
+
+	while(e) {
+		struct pagecache_entry *next = (struct pagecache_entry *) e->node.next;
+		if(e->volume == d->volume && e->inumber == d->inumber) {
+			pagecache_entry_delete(e);
+		}
+		e = next;
+	}
+}
+
+void pagecache_invalidate_volume( struct fs_volume *v )
+{
+	struct pagecache_entry *e = (struct pagecache_entry *) lru.head;
+
+	while(e) {
+		struct pagecache_entry *next = (struct pagecache_entry *) e->node.next;
+		if(e->volume == v) {
+			pagecache_entry_delete(e);
+		}
+		e = next;
+	}
+}
+
+void pagecache_debug()
+{
+	printf("pagecache: %d pages, %d hits, %d misses\n", list_size(&lru), hits, misses);
+}
@@ -0,0 +1,23 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include "fs.h"
+
+/*
+The page cache holds whole pages of file contents, keyed by
+volume, file, and page-aligned offset, so that several processes
+running the same program can map the same read-only text pages.
+*/
+
+void *pagecache_get( struct fs_dirent *d, uint32_t offset );
+void  pagecache_invalidate( struct fs_dirent *d );
+void  pagecache_invalidate_volume( struct fs_volume *v );
+void  pagecache_debug();
+
+#endif
@@ -8,10 +8,35 @@ See the file LICENSE for details.
 #include "page.h"
 #include "string.h"
 #include "kernelcore.h"
+#include "process.h"
+#include "memorylayout.h"
 #include "log.c"
 
 #define ENTRIES_PER_TABLE (PAGE_SIZE / 4)
 
+/*
+The avail bits of a page entry are ours to use.
+PAGE_AVAIL_ALLOC marks a page owned by this pagetable,
+which must be freed along with it.  PAGE_AVAIL_COW marks
+a writable page temporarily mapped read-only because it is
+shared with another pagetable since a fork.  The first write
+to it faults, and pagetable_copy_on_write() gives this
+pagetable its own copy.
+*/
+
+#define PAGE_AVAIL_ALLOC 1
+#define PAGE_AVAIL_COW   2
+
+/*
+Changing an entry of the loaded pagetable only requires
+invalidating the TLB entry for that page with invlpg.
+When a range of more than PAGETABLE_FLUSH_THRESHOLD pages
+changes at once, a single reload of CR3 is cheaper.
+Kernel pages are global, and survive either one.
+*/
+
+#define PAGETABLE_FLUSH_THRESHOLD 32
+
 struct pageentry {
     unsigned present:1;
     unsigned readwrite:1;
@@ -30,30 +55,124 @@ struct pagetable {
     struct pageentry entry[ENTRIES_PER_TABLE];
 };
 
+/*
+The kernel direct map of physical memory and the video buffer
+are mapped with 4MB pages, and are the same in every pagetable.
+They are built once in kernel_directory, and pagetable_init only
+copies those directory entries, so that the kernel part of an
+address space needs no second level tables at all.
+*/
+
+#define LARGE_PAGE_SIZE (PAGE_SIZE * ENTRIES_PER_TABLE)
+
+static struct pagetable *kernel_directory = 0;
+
+/*
+A directory emptied by pagetable_delete holds only the kernel
+entries, which is exactly what pagetable_init would build.
+A few are kept to be handed out by pagetable_create_space,
+so that a short-lived process need not clear and fill a new one.
+*/
+
+#define PAGETABLE_SPARE_MAX 16
+
+static struct pagetable *spare_directories[PAGETABLE_SPARE_MAX];
+static int spare_directory_count = 0;
+
 struct pagetable *pagetable_create()
 {
 	return page_alloc(1);
 }
 
+static int pagetable_is_loaded(struct pagetable *p)
+{
+	struct pagetable *loaded;
+	asm("mov %%cr3, %0" : "=r"(loaded));
+	return loaded == p;
+}
+
+/*
+A local invlpg is enough: the threads sharing a pagetable are all
+kept on one processor, see process_pinned.
+*/
+
+static void pagetable_flush_page(struct pagetable *p, unsigned vaddr)
+{
+	if(!pagetable_is_loaded(p))
+		return;
+	asm volatile("invlpg (%0)" :: "r"(vaddr) : "memory");
+	if(current)
+		current->stats.tlb_page_flushes++;
+}
+
+static void pagetable_map_large(struct pagetable *p, unsigned vaddr, unsigned paddr)
+{
+    struct pageentry *e = &p->entry[vaddr >> 22];
+
+    e->present = 1;
+    e->readwrite = 1;
+    e->user = 0;
+    e->writethrough = 0;
+    e->nocache = 0;
+    e->accessed = 0;
+    e->dirty = 0;
+    e->pagesize = 1;
+    e->globalpage = 1;
+    e->avail = 0;
+    e->addr = (paddr >> 12);
+}
+
+static void pagetable_kernel_init()
+{
+    unsigned i, start, npages;
+
+    kernel_directory = pagetable_create();
+
+    npages = (total_memory * 1024 * 1024 + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+    for (i = 0; i < npages; i++) {
+        pagetable_map_large(kernel_directory, i * LARGE_PAGE_SIZE, i * LARGE_PAGE_SIZE);
+    }
+
+    start = (unsigned)video_buffer & ~(LARGE_PAGE_SIZE - 1);
+    npages = ((unsigned)video_buffer - start + video_xres * video_yres * 3 + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+    for (i = 0; i < npages; i++) {
+        pagetable_map_large(kernel_directory, start + i * LARGE_PAGE_SIZE, start + i * LARGE_PAGE_SIZE);
+    }
+
+    // Device registers must not be cached.
+    pagetable_map_large(kernel_directory, APIC_REGION_START, APIC_REGION_START);
+    kernel_directory->entry[APIC_REGION_START >> 22].nocache = 1;
+    kernel_directory->entry[APIC_REGION_START >> 22].writethrough = 1;
+}
+
 void pagetable_init(struct pagetable *p) {
-   
-    unsigned i, Max, End;
-    Max = total_memory * 1024 * 1024;
+    unsigned i;
 
-    for (i = 0; i < Max; i += PAGE_SIZE) {
-        if (!pagetable_map(p, i, i, PAGE_FLAG_KERNEL | PAGE_FLAG_READWRITE)) {
-            log_error("Failed to map page in pagetable_init.");
-        }
+    if (!kernel_directory) {
+        pagetable_kernel_init();
     }
 
-    End = (unsigned)video_buffer + video_xres * video_yres * 3;
-    for (i = (unsigned)video_buffer; i <= End; i += PAGE_SIZE) {
-        if (!pagetable_map(p, i, i, PAGE_FLAG_KERNEL | PAGE_FLAG_READWRITE)) {
-            log_error("Failed to map video buffer in pagetable_init.");
+    for (i = 0; i < ENTRIES_PER_TABLE; i++) {
+        if (kernel_directory->entry[i].present) {
+            p->entry[i] = kernel_directory->entry[i];
         }
     }
 }
 
+struct pagetable *pagetable_create_space() {
+    struct pagetable *p;
+
+    if (spare_directory_count > 0) {
+        return spare_directories[--spare_directory_count];
+    }
+
+    p = pagetable_create();
+    if (p) {
+        pagetable_init(p);
+    }
+    return p;
+}
+
 
 int pagetable_getmap(struct pagetable *p, unsigned vaddr, unsigned *paddr, int *flags) {
     if (!p || !paddr) {
@@ -70,16 +189,20 @@ int pagetable_getmap(struct pagetable *p, unsigned vaddr, unsigned *paddr, int *
     e = &p->entry[p_direc_indx];
     if (!e->present) return 0;
 
-    q = (struct pagetable *)(e->addr << 12);
-    e = &q->entry[p_tble_indx];
-    if (!e->present) return 0;
+    if (e->pagesize) {
+        *paddr = (e->addr << 12) + (vaddr & (LARGE_PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    } else {
+        q = (struct pagetable *)(e->addr << 12);
+        e = &q->entry[p_tble_indx];
+        if (!e->present) return 0;
 
-    *paddr = e->addr << 12;
+        *paddr = e->addr << 12;
+    }
 
     if (flags) {
         *flags = 0;
         if (e->readwrite) *flags |= PAGE_FLAG_READWRITE;
-        if (e->avail & 0x01) *flags |= PAGE_FLAG_ALLOC;
+        if (e->avail & PAGE_AVAIL_ALLOC) *flags |= PAGE_FLAG_ALLOC;
         if (!e->user) *flags |= PAGE_FLAG_KERNEL;
     }
 
@@ -128,11 +251,16 @@ int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags
         e->globalpage = (flags & PAGE_FLAG_KERNEL) ? 1 : 0;
         e->avail = 0;
         e->addr = (((unsigned)q) >> 12);
+    } else if (e->pagesize) {
+        log_error("Cannot map a page within a large page in pagetable_map.");
+        if (flags & PAGE_FLAG_ALLOC) page_free((void *)paddr);
+        return 0;
     } else {
         q = (struct pagetable *)(((unsigned)e->addr) << 12);
     }
 
     e = &q->entry[p_tble_indx];
+    int was_present = e->present;
     e->present = 1;
     e->readwrite = (flags & PAGE_FLAG_READWRITE) ? 1 : 0;
     e->user = (flags & PAGE_FLAG_KERNEL) ? 0 : 1;
@@ -142,30 +270,38 @@ int pagetable_map(struct pagetable *p, unsigned vaddr, unsigned paddr, int flags
     e->dirty = 0;
     e->pagesize = 0;
     e->globalpage = !e->user;
-    e->avail = (flags & PAGE_FLAG_ALLOC) ? 1 : 0;
+    e->avail = (flags & (PAGE_FLAG_ALLOC | PAGE_FLAG_SHARED)) ? PAGE_AVAIL_ALLOC : 0;
     e->addr = (paddr >> 12);
 
+    // Entries that were not present cannot be in the TLB.
+    if (was_present) pagetable_flush_page(p, vaddr);
+
     return 1;
 }
 
-void pagetable_unmap(struct pagetable *p, unsigned vaddr) {
-    if (!p) {
-        log_error("Invalid pagetable in pagetable_unmap.");
-        return;
-    }
-
+static void pagetable_clear(struct pagetable *p, unsigned vaddr) {
     struct pagetable *q;
     struct pageentry *e;
     unsigned p_direc_indx = vaddr >> 22;
     unsigned p_tble_indx = (vaddr >> 12) & 0x3ff;
 
     e = &p->entry[p_direc_indx];
-    if (e->present) {
+    if (e->present && !e->pagesize) {
         q = (struct pagetable *)(e->addr << 12);
         e = &q->entry[p_tble_indx];
         e->present = 0;
     }
 }
+
+void pagetable_unmap(struct pagetable *p, unsigned vaddr) {
+    if (!p) {
+        log_error("Invalid pagetable in pagetable_unmap.");
+        return;
+    }
+
+    pagetable_clear(p, vaddr);
+    pagetable_flush_page(p, vaddr);
+}
 void pagetable_delete(struct pagetable *p)
 {
 	unsigned i, j;
@@ -175,7 +311,7 @@ void pagetable_delete(struct pagetable *p)
 
 	for(i = 0; i < ENTRIES_PER_TABLE; i++) {
 		e = &p->entry[i];
-		if(e->present) {
+		if(e->present && !e->pagesize) {
 			q = (struct pagetable *) (e->addr << 12);
 			for(j = 0; j < ENTRIES_PER_TABLE; j++) {
 				e = &q->entry[j];
@@ -186,19 +322,25 @@ void pagetable_delete(struct pagetable *p)
 				}
 			}
 			page_free(q);
+			memset(&p->entry[i], 0, sizeof(struct pageentry));
 		}
 	}
 
-	page_free(p);
+	if(spare_directory_count < PAGETABLE_SPARE_MAX) {
+		spare_directories[spare_directory_count++] = p;
+	} else {
+		page_free(p);
+	}
 }
 
-void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int flags) {
+int pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int flags) {
     if (!p) {
         log_error("Invalid pagetable in pagetable_alloc.");
-        return;
+        return 0;
     }
 
     unsigned npages = length / PAGE_SIZE;
+    int mapped = 0;
 
 	if(length % PAGE_SIZE)
 		npages++;
@@ -210,17 +352,20 @@ void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int f
         if (!pagetable_getmap(p, vaddr, &paddr, 0)) {
             if (!pagetable_map(p, vaddr, 0, flags | PAGE_FLAG_ALLOC)) {
                 log_error("Failed to map page in pagetable_alloc.");
+            } else {
+                mapped++;
             }
         }
         vaddr += PAGE_SIZE;
         npages--;
     }
+    return mapped;
 }
 
-void pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length) {
+int pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length) {
     if (!p) {
         log_error("Invalid pagetable in pagetable_free.");
-        return;
+        return 0;
     }
 
     unsigned npages = length / PAGE_SIZE;
@@ -229,16 +374,24 @@ void pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length) {
 		npages++;
     vaddr &= 0xfffff000;
 
+    int flush_each = npages <= PAGETABLE_FLUSH_THRESHOLD;
+    int unmapped = 0;
+
     while (npages > 0) {
         unsigned paddr;
         int flags;
         if (pagetable_getmap(p, vaddr, &paddr, &flags)) {
-            pagetable_unmap(p, vaddr);
+            pagetable_clear(p, vaddr);
+            if (flush_each) pagetable_flush_page(p, vaddr);
             if (flags & PAGE_FLAG_ALLOC) page_free((void *)paddr);
+            unmapped++;
         }
         vaddr += PAGE_SIZE;
         npages--;
     }
+
+    if (!flush_each && pagetable_is_loaded(p)) pagetable_refresh();
+    return unmapped;
 }
 
 
@@ -254,12 +407,17 @@ void pagetable_refresh()
 {
 	asm("mov %cr3, %eax");
 	asm("mov %eax, %cr3");
+	if(current)
+		current->stats.tlb_flushes++;
 }
 
 void pagetable_enable()
 {
+	asm("movl %cr4, %eax");
+	asm("orl $0x90, %eax");	// page size extension for 4MB kernel pages, and global pages
+	asm("movl %eax, %cr4");
 	asm("movl %cr0, %eax");
-	asm("orl $0x80000000, %eax");
+	asm("orl $0x80010000, %eax");	// paging, and write protect for copy on write
 	asm("movl %eax, %cr0");
 }
 
@@ -272,14 +430,16 @@ struct pagetable *pagetable_duplicate(struct pagetable *sp)
 
 	struct pageentry *newe;
 	struct pagetable *newq;
-	struct pagetable *newp = pagetable_create();
+	struct pagetable *newp = pagetable_create_space();
 	if(!newp)
 		goto cleanup;
 
 	for(i = 0; i < ENTRIES_PER_TABLE; i++) {
 		e = &sp->entry[i];
 		newe = &newp->entry[i];
-		if(e->present) {
+		if(e->present && e->pagesize) {
+			memcpy(newe, e, sizeof(struct pageentry));
+		} else if(e->present) {
 			q = (struct pagetable *) (e->addr << 12);
 			newq = pagetable_create();
 			if(!newq)
@@ -289,21 +449,15 @@ struct pagetable *pagetable_duplicate(struct pagetable *sp)
 			for(j = 0; j < ENTRIES_PER_TABLE; j++) {
 				e = &q->entry[j];
 				newe = &newq->entry[j];
-				memcpy(newe, e, sizeof(struct pageentry));
-				if(e->present) {
-					void *paddr;
-					paddr = (void *) (e->addr << 12);
-					void *new_paddr = 0;
-					if(e->avail) {
-						new_paddr = page_alloc(0);
-						if(!new_paddr)
-							goto cleanup;
-						memcpy(new_paddr, paddr, PAGE_SIZE);
-					} else {
-						new_paddr = paddr;
+				if(e->present && (e->avail & PAGE_AVAIL_ALLOC)) {
+					/* Share the page, and make both sides copy it on the next write. */
+					if(e->readwrite) {
+						e->readwrite = 0;
+						e->avail |= PAGE_AVAIL_COW;
 					}
-					newe->addr = (((unsigned) new_paddr) >> 12);
+					page_addref((void *) (e->addr << 12));
 				}
+				memcpy(newe, e, sizeof(struct pageentry));
 			}
 		}
 	}
@@ -315,4 +469,41 @@ struct pagetable *pagetable_duplicate(struct pagetable *sp)
 	}
 	return 0;
 }
+
+int pagetable_copy_on_write(struct pagetable *p, unsigned vaddr)
+{
+	struct pagetable *q;
+	struct pageentry *e;
+	void *paddr;
+	int copied = 0;
+
+	e = &p->entry[vaddr >> 22];
+	if(!e->present)
+		return -1;
+
+	q = (struct pagetable *) (e->addr << 12);
+	e = &q->entry[(vaddr >> 12) & 0x3ff];
+	if(!e->present || !(e->avail & PAGE_AVAIL_COW))
+		return -1;
+
+	paddr = (void *) (e->addr << 12);
+
+	/* If the other sharers are all gone, simply take the page back. */
+	if(page_refcount(paddr) > 1) {
+		void *new_paddr = page_alloc(0);
+		if(!new_paddr)
+			return -1;
+		memcpy(new_paddr, paddr, PAGE_SIZE);
+		page_free(paddr);
+		e->addr = (((unsigned) new_paddr) >> 12);
+		copied = 1;
+	}
+
+	e->readwrite = 1;
+	e->avail &= ~PAGE_AVAIL_COW;
+	pagetable_flush_page(p, vaddr);
+
+	return copied;
+}
+
 void pagetable_copy(struct pagetable *sp, unsigned saddr, struct pagetable *tp, unsigned taddr, unsigned length);
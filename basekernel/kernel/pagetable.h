@@ -38,6 +38,7 @@
 #define PAGE_FLAG_READWRITE   4
 #define PAGE_FLAG_NOCLEAR     0
 #define PAGE_FLAG_CLEAR       8
+#define PAGE_FLAG_SHARED      16
 
 /*************************************************************************
 * Breakdown of a Virtual Address
@@ -70,12 +71,26 @@ struct pagetable *pagetable_create();
  * @brief Initializes a page table
  *
  * The pagetable_init() function initializes a page table, setting up its
- * internal structures and preparing it for use.
+ * internal structures and preparing it for use. The kernel mappings of
+ * physical memory and the video buffer use 4MB pages and are copied from
+ * a directory shared by all page tables, built on the first call.
  *
  * @param p is a pointer to the page table to be initialized
  */
 void pagetable_init(struct pagetable *p);
 
+/**
+ * @brief Creates the page table of a new address space
+ *
+ * The pagetable_create_space() function returns a page table that already
+ * holds the kernel mappings, as if made by pagetable_create() and then
+ * pagetable_init(), but reuses a directory left by pagetable_delete() when
+ * one is available.
+ *
+ * @return a pointer to the new page table, or zero if out of memory
+ */
+struct pagetable *pagetable_create_space();
+
 /**
  * @brief Maps a virtual address to a physical address
  *
@@ -128,8 +143,9 @@ void pagetable_unmap(struct pagetable *p, unsigned vaddr);
  * @param vaddr is the starting virtual address of the range to be allocated
  * @param length is the length of the range to be allocated
  * @param flags are the flags to be used for the allocation
+ * @return the number of pages newly mapped, those already present being left alone
  */
-void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int flags);
+int pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int flags);
 
 /**
  * @brief Frees a range of virtual addresses
@@ -140,8 +156,9 @@ void pagetable_alloc(struct pagetable *p, unsigned vaddr, unsigned length, int f
  * @param p is a pointer to the page table
  * @param vaddr is the starting virtual address of the range to be freed
  * @param length is the length of the range to be freed
+ * @return the number of pages that were mapped and are now unmapped
  */
-void pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length);
+int pagetable_free(struct pagetable *p, unsigned vaddr, unsigned length);
 
 /**
  * @brief Loads a page table
@@ -206,6 +223,36 @@ void pagetable_unload(struct pagetable *p);
 //to comment
 void pagetable_delete(struct pagetable *p);
 
+/**
+ * @brief Duplicates a page table for a forked process
+ *
+ * The pagetable_duplicate() function creates a new page table with the same
+ * mappings as the given one. Pages owned by the source are not copied: they
+ * become shared by both page tables, and writable ones are marked read-only
+ * and copy on write in both, so that they are copied on the first write.
+ * The caller must refresh the TLB if the source page table is loaded.
+ *
+ * @param p is a pointer to the page table to be duplicated
+ *
+ * @return a pointer to the new page table, or zero on failure
+ */
+struct pagetable *pagetable_duplicate(struct pagetable *p);
+
+/**
+ * @brief Resolves a write fault on a copy on write page
+ *
+ * The pagetable_copy_on_write() function gives the page table a private,
+ * writable copy of a page shared since a fork. If no other page table
+ * still shares the page, it is made writable again without copying.
+ *
+ * @param p is a pointer to the page table
+ * @param vaddr is the faulting virtual address
+ *
+ * @return 1 if the page was copied, 0 if it was reclaimed without a copy,
+ * or -1 if vaddr is not a copy on write page
+ */
+int pagetable_copy_on_write(struct pagetable *p, unsigned vaddr);
+
 void pagetable_refresh();
 
 #endif
@@ -6,7 +6,7 @@ See the file LICENSE for details.
 
 #include "kernel/types.h"
 #include "pipe.h"
-#include "kmalloc.h"
+#include "slab.h"
 #include "process.h"
 #include "page.h"
 
@@ -21,14 +21,16 @@ struct pipe {
 	struct list queue;
 };
 
+static struct kmem_cache pipe_cache = KMEM_CACHE_INIT("pipe", sizeof(struct pipe));
+
 struct pipe *pipe_create()
 {
-	struct pipe *p = kmalloc(sizeof(*p));
+	struct pipe *p = kmem_cache_alloc(&pipe_cache);
 	if(!p) return 0;
 	
 	p->buffer = page_alloc(1);
 	if(!p->buffer) {
-		kfree(p);
+		kmem_cache_free(&pipe_cache, p);
 		return 0;
 	}
 	p->read_pos = 0;
@@ -62,7 +64,7 @@ void pipe_delete(struct pipe *p)
 		if(p->buffer) {
 			page_free(p->buffer);
 		}
-		kfree(p);
+		kmem_cache_free(&pipe_cache, p);
 	}
 }
 
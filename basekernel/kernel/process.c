@@ -18,15 +18,149 @@ See the file LICENSE for details.
 #include "main.h"
 #include "keyboard.h"
 #include "clock.h"
+#include "pagecache.h"
+#include "smp.h"
 
-struct process *current = 0;
-struct list ready_list = { 0, 0 };
+struct cpu cpu_table[PROCESS_MAX_CPUS];
+int cpu_count = 1;
 struct list grave_list = { 0, 0 };
-struct list grave_watcher_list = { 0, 0 };	// parent processes are put here to wait for their children
-struct process *process_table[PROCESS_MAX_PID] = { 0 };
+
+/*
+The process table is a directory of pages of process pointers,
+each page allocated when a pid in its range is first used, so that
+a large pid space costs nothing until it is used.  Free pids are
+found in a bitmap, with a second bitmap of the words that are full,
+so that allocation looks at a few words rather than every pid.
+All processes are also kept on process_list, for the few operations
+that must visit every one.
+*/
+
+#define PROCESS_TABLE_CHUNK (PAGE_SIZE / sizeof(struct process *))
+#define PROCESS_PID_WORDS (PROCESS_MAX_PID / 32)
+
+static struct process **process_table[PROCESS_MAX_PID / PROCESS_TABLE_CHUNK];
+static uint32_t pid_map[PROCESS_MAX_PID / 32] = { 1 };	// pid 0 is never allocated
+static uint32_t pid_full[PROCESS_PID_WORDS / 32];
+static struct list process_list = { 0, 0 };
+
+#define process_from(n, field) ((struct process *) ((char *) (n) - __builtin_offsetof(struct process, field)))
+
+/*
+Ready processes wait in a multi-level feedback queue.  A process
+at level k runs for (quantum << k) clock ticks before it is
+preempted; if it used up the whole slice, it sinks one level.
+A process that wakes up after waiting for user input returns to
+the level of its priority, so that interactive programs stay
+ahead of CPU-bound ones, and every PROCESS_BOOST_TICKS all
+processes are raised to their priority so that none starves.
+The time from a wakeup until the process runs is recorded in
+a histogram of scheduler latency.
+
+Each processor has its own set of ready queues.  A process goes
+back to the queues of the processor it last ran on, and a processor
+with nothing to run takes work from the busiest of the others.
+*/
+
+static int process_quantum = PROCESS_QUANTUM_DEFAULT;
+static int sched_switches = 0;
+static int sched_preemptions = 0;
+static int sched_latency[SCHED_LATENCY_BUCKETS] = { 0 };
+
+/*
+If the processor has SSE2 and fxsave, the kernel turns SSE on
+so that user programs (and the user library memcpy) may use it,
+and saves the FPU and SSE registers of each process across a
+switch.  The kernel itself is compiled without SSE, so the
+registers need not be saved on every interrupt.
+*/
+
+/*
+Kernel stacks of deleted processes are kept for reuse, up to
+PROCESS_SPARE_KSTACKS of them, so that a burst of short-lived
+processes does not go back to the page allocator every time.
+A kernel stack needs no clearing: only the frame at its top is
+ever read before being written, and that is cleared here.
+*/
+
+#define PROCESS_SPARE_KSTACKS 16
+
+static char *spare_kstacks[PROCESS_SPARE_KSTACKS];
+static int spare_kstack_count = 0;
+
+static char *process_kstack_alloc()
+{
+	if(spare_kstack_count > 0)
+		return spare_kstacks[--spare_kstack_count];
+	return page_alloc(0);
+}
+
+static void process_kstack_free(char *kstack)
+{
+	if(spare_kstack_count < PROCESS_SPARE_KSTACKS) {
+		spare_kstacks[spare_kstack_count++] = kstack;
+	} else {
+		page_free(kstack);
+	}
+}
+
+static int process_fpu_enabled = 0;
+static char process_fpu_initial[PROCESS_FPU_SIZE + 16];
+
+static void *process_fpu_align(char *area)
+{
+	return (void *) (((addr_t) area + 15) & ~15);
+}
+
+static void *process_fpu_state(struct process *p)
+{
+	return process_fpu_align(p->fpu_area);
+}
+
+static void process_fpu_init()
+{
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+	// SSE2 is bit 26 and fxsave/fxrstor is bit 24 of edx.
+	if(!(edx & (1 << 26)) || !(edx & (1 << 24)))
+		return;
+
+	process_fpu_enabled = 1;
+	process_fpu_cpu_init();
+
+	asm volatile("fninit");
+	asm volatile("fxsave (%0)"::"r"(process_fpu_align(process_fpu_initial)) : "memory");
+}
+
+/* Turns on SSE in the calling processor, once process_fpu_init has found it. */
+
+void process_fpu_cpu_init()
+{
+	if(!process_fpu_enabled)
+		return;
+
+	asm("movl %cr4, %eax");
+	asm("orl $0x600, %eax");	// OSFXSR and OSXMMEXCPT
+	asm("movl %eax, %cr4");
+	asm("movl %cr0, %eax");
+	asm("andl $0xfffffffb, %eax");	// clear EM: no FPU emulation
+	asm("orl $0x2, %eax");	// set MP: monitor coprocessor
+	asm("movl %eax, %cr0");
+}
+
+/* Gives child the live FPU state of parent, which must be current. */
+
+void process_fpu_copy(struct process *parent, struct process *child)
+{
+	if(process_fpu_enabled && parent == current) {
+		asm volatile("fxsave (%0)"::"r"(process_fpu_state(child)) : "memory");
+	}
+}
 
 void process_init()
 {
+	process_fpu_init();
+
 	current = process_create();
 
 	pagetable_load(current->pagetable);
@@ -34,7 +168,8 @@ void process_init()
 
 	current->state = PROCESS_STATE_READY;
 
-	current->waiting_for_child_pid = 0;
+
+	cpu_self()->idle = process_create_idle(0);
 }
 
 void process_kstack_reset(struct process *p, unsigned entry_point)
@@ -60,6 +195,24 @@ void process_kstack_reset(struct process *p, unsigned entry_point)
 	s->ss = X86_SEGMENT_USER_DATA;
 }
 
+/* Like process_kstack_reset, but the process starts at entry in kernel mode. */
+
+static void process_kstack_reset_kernel(struct process *p, void (*entry) ())
+{
+	struct x86_stack *s;
+
+	process_kstack_reset(p, (unsigned) entry);
+
+	s = (struct x86_stack *) p->kstack_ptr;
+	s->gs = X86_SEGMENT_PERCPU;
+	s->es = X86_SEGMENT_KERNEL_DATA;
+	s->ds = X86_SEGMENT_KERNEL_DATA;
+	s->cs = X86_SEGMENT_KERNEL_CODE;
+	s->eflags.interrupt = 0;
+	s->eflags.iopl = 0;
+	s->ss = X86_SEGMENT_KERNEL_DATA;
+}
+
 void process_kstack_copy(struct process *parent, struct process *child)
 {
 	child->kstack_top = child->kstack + PAGE_SIZE - 8;
@@ -76,6 +229,47 @@ void process_kstack_copy(struct process *parent, struct process *child)
 	child_regs->regs1.eax = 0;
 }
 
+struct process *process_lookup(uint32_t pid)
+{
+	if(pid >= PROCESS_MAX_PID || !process_table[pid / PROCESS_TABLE_CHUNK])
+		return 0;
+	return process_table[pid / PROCESS_TABLE_CHUNK][pid % PROCESS_TABLE_CHUNK];
+}
+
+static int process_table_set(uint32_t pid, struct process *p)
+{
+	struct process ***chunk = &process_table[pid / PROCESS_TABLE_CHUNK];
+	if(!*chunk) {
+		*chunk = page_alloc(1);
+		if(!*chunk)
+			return 0;
+	}
+	(*chunk)[pid % PROCESS_TABLE_CHUNK] = p;
+	return 1;
+}
+
+/* Returns the first free pid at or after start, or -1. */
+
+static int process_find_pid(int start)
+{
+	int w = start / 32;
+	if(w >= PROCESS_PID_WORDS)
+		return -1;
+
+	uint32_t bits = ~pid_map[w] & (~0u << (start % 32));
+	if(bits)
+		return w * 32 + __builtin_ctz(bits);
+
+	for(w++; w < PROCESS_PID_WORDS; w = (w / 32 + 1) * 32) {
+		uint32_t words = ~pid_full[w / 32] & (~0u << (w % 32));
+		if(words) {
+			w = (w / 32) * 32 + __builtin_ctz(words);
+			return w * 32 + __builtin_ctz(~pid_map[w]);
+		}
+	}
+	return -1;
+}
+
 /*
 Valid pids start at 1 and go to PROCESS_MAX_PID.
 To avoid confusion, keep picking increasing
@@ -87,23 +281,61 @@ static int process_allocate_pid()
 {
 	static int last = 0;
 
-	int i;
+	int pid = process_find_pid(last + 1);
+	if(pid < 0)
+		pid = process_find_pid(1);
+	if(pid < 0)
+		return 0;
 
-	for(i = last + 1; i < PROCESS_MAX_PID; i++) {
-		if(!process_table[i]) {
-			last = i;
-			return i;
-		}
-	}
+	pid_map[pid / 32] |= 1u << (pid % 32);
+	if(pid_map[pid / 32] == ~0u)
+		pid_full[pid / 1024] |= 1u << (pid / 32 % 32);
 
-	for(i = 1; i < last; i++) {
-		if(!process_table[i]) {
-			last = i;
-			return i;
+	last = pid;
+	return pid;
+}
+
+static void process_free_pid(int pid)
+{
+	pid_map[pid / 32] &= ~(1u << (pid % 32));
+	pid_full[pid / 1024] &= ~(1u << (pid / 32 % 32));
+	process_table_set(pid, 0);
+}
+
+/*
+Each process keeps its living children on one list and its dead
+ones, until reaped, on another, so that kill, wait and reap only
+look at the children concerned.
+*/
+
+static void process_set_parent(struct process *child, struct process *parent)
+{
+	if(child->parent)
+		list_remove(&child->sibling);
+	child->ppid = parent->pid;
+	child->parent = parent;
+	list_push_tail(&parent->children, &child->sibling);
+}
+
+/*
+Puts p in the grave, and wakes those waiting for it: the waiters
+on its parent's child_wait queue, and those waiting for p by pid.
+A thread leaves the children of its parent at once, since it is
+only ever joined, and never reported by process_wait_child.
+*/
+
+static void process_bury(struct process *p)
+{
+	p->state = PROCESS_STATE_GRAVE;
+	list_push_tail(&grave_list, &p->node);
+	if(p->parent) {
+		list_remove(&p->sibling);
+		if(p->leader == p) {
+			list_push_tail(&p->parent->zombies, &p->sibling);
+			process_wakeup_all(&p->parent->child_wait);
 		}
 	}
-
-	return 0;
+	process_wakeup_all(&p->joiners);
 }
 
 void process_selective_inherit(struct process *parent, struct process *child, int * fds, int length)
@@ -111,31 +343,39 @@ void process_selective_inherit(struct process *parent, struct process *child, in
 	int i;
 
 	for (i=0;i<length;i++) {
-		if(fds[i]>-1) {
+		if(fds[i]>-1 && fds[i]<PROCESS_MAX_OBJECTS && parent->ktable[fds[i]]) {
 			child->ktable[i] = kobject_copy(parent->ktable[fds[i]]);
 		} else {
 			child->ktable[i] = 0;
 		}
 	}
 
-	child->ppid = parent->pid;
+	process_set_parent(child, parent);
 }
 
 void process_inherit(struct process *parent, struct process *child)
 {
 	/* Child inherits everything parent inherits */
 	int i;
-	int * fds = kmalloc(sizeof(int)*PROCESS_MAX_OBJECTS);
 	for (i = 0; i < PROCESS_MAX_OBJECTS; i++)
 	{
 		if (parent->ktable[i]) {
-			fds[i] = i;
+			child->ktable[i] = kobject_copy(parent->ktable[i]);
 		} else {
-			fds[i] = -1;
+			child->ktable[i] = 0;
 		}
 	}
-	process_selective_inherit(parent, child, fds, PROCESS_MAX_OBJECTS);
-	kfree(fds);
+	process_set_parent(child, parent);
+}
+
+/* Counts pages mapped (or unmapped, if negative) in the address space of p. */
+
+void process_resident_add(struct process *p, int pages)
+{
+	struct process_stats *s = &p->leader->stats;
+	s->resident_pages += pages;
+	if(s->resident_pages > s->peak_resident_pages)
+		s->peak_resident_pages = s->resident_pages;
 }
 
 int process_data_size_set(struct process *p, unsigned size)
@@ -148,17 +388,15 @@ int process_data_size_set(struct process *p, unsigned size)
 	}
 
 	if(size > p->vm_data_size) {
-		uint32_t start = PROCESS_ENTRY_POINT + p->vm_data_size;
-		pagetable_alloc(p->pagetable, start, size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
+		// New data pages are zero-filled by the page fault handler on first touch.
 	} else if(size < p->vm_data_size) {
 		uint32_t start = PROCESS_ENTRY_POINT + size;
-		pagetable_free(p->pagetable, start, p->vm_data_size);
+		process_resident_add(p, -pagetable_free(p->pagetable, start, p->vm_data_size));
 	} else {
 		// requested size is equal to current.
 	}
 
 	p->vm_data_size = size;
-	pagetable_refresh();
 
 	return 0;
 }
@@ -170,14 +408,102 @@ int process_stack_size_set(struct process *p, unsigned size)
 
 	if(size > p->vm_stack_size) {
 		uint32_t start = -size;
-		pagetable_alloc(p->pagetable, start, size - p->vm_stack_size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR);
+		process_resident_add(p, pagetable_alloc(p->pagetable, start, size - p->vm_stack_size, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_CLEAR));
 	} else {
 		uint32_t start = -p->vm_stack_size;
-		pagetable_free(p->pagetable, start, p->vm_stack_size - size);
+		process_resident_add(p, -pagetable_free(p->pagetable, start, p->vm_stack_size - size));
 	}
 
 	p->vm_stack_size = size;
-	pagetable_refresh();
+
+	return 0;
+}
+
+/*
+The program image is loaded on demand.  elf_load records which
+part of which file backs the image, and leaves those pages unmapped.
+The first touch of each page faults, and process_image_fault
+fills it in from the file, through the buffer cache.
+The first text_length bytes of the image are read-only text:
+whole pages of it are mapped read-only from the page cache,
+and so are shared by all processes running the same program.
+*/
+
+void process_image_set(struct process *p, struct fs_dirent *d, uint32_t offset, uint32_t vaddr, uint32_t length, uint32_t text_length)
+{
+	if(d) fs_dirent_addref(d);
+	if(p->image) fs_dirent_close(p->image);
+
+	p->image = d;
+	p->image_offset = offset;
+	p->image_vaddr = vaddr;
+	p->image_length = length;
+	p->image_text_length = text_length;
+}
+
+int process_image_contains(struct process *p, unsigned vaddr)
+{
+	if(!p->image) return 0;
+
+	// Whole pages, since the last one may also hold bss or other data past the file bytes.
+	uint32_t start = p->image_vaddr & ~(PAGE_SIZE - 1);
+	uint32_t end = (p->image_vaddr + p->image_length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	return vaddr >= start && vaddr < end;
+}
+
+/*
+Reading the file may yield, and the pagetable is shared by the
+threads of p, so a page is filled before it is mapped: no thread
+ever sees it partly read.  If another thread faulted on the same
+page and mapped it in the meantime, its copy is kept.
+*/
+
+int process_image_fault(struct process *p, unsigned vaddr)
+{
+	uint32_t page = vaddr & ~(PAGE_SIZE - 1);
+	uint32_t start = MAX(page, p->image_vaddr);
+	uint32_t end = MIN(page + PAGE_SIZE, p->image_vaddr + p->image_length);
+	unsigned mapped;
+
+	if(page >= p->image_vaddr && page + PAGE_SIZE <= p->image_vaddr + p->image_text_length) {
+		void *paddr = pagecache_get(p->image, p->image_offset + (page - p->image_vaddr));
+		if(!paddr) {
+			return KERROR_EXECUTION_FAILED;
+		}
+		if(pagetable_getmap(p->pagetable, page, &mapped, 0)) {
+			page_free(paddr);
+			return 0;
+		}
+		if(!pagetable_map(p->pagetable, page, (unsigned) paddr, PAGE_FLAG_USER | PAGE_FLAG_READONLY | PAGE_FLAG_SHARED)) {
+			page_free(paddr);
+			return KERROR_OUT_OF_MEMORY;
+		}
+		process_resident_add(p, 1);
+		return 0;
+	}
+
+	char *data = page_alloc(1);
+	if(!data) {
+		return KERROR_OUT_OF_MEMORY;
+	}
+
+	/* The page is zeroed, so only the part backed by the file is read. */
+	uint32_t length = end - start;
+	if(fs_dirent_read(p->image, data + (start - page), length, p->image_offset + (start - p->image_vaddr)) != length) {
+		page_free(data);
+		return KERROR_EXECUTION_FAILED;
+	}
+
+	if(pagetable_getmap(p->pagetable, page, &mapped, 0)) {
+		page_free(data);
+		return 0;
+	}
+	if(!pagetable_map(p->pagetable, page, (unsigned) data, PAGE_FLAG_USER | PAGE_FLAG_READWRITE | PAGE_FLAG_SHARED)) {
+		page_free(data);
+		return KERROR_OUT_OF_MEMORY;
+	}
+	process_resident_add(p, 1);
 
 	return 0;
 }
@@ -188,35 +514,76 @@ void process_stack_reset(struct process *p, unsigned size)
 	memset((void *) -size, size, 0);
 }
 
-struct process *process_create()
+/*
+A thread is a process that shares the pagetable and object table
+of its leader, the process that created the first of them, and has
+a kernel stack and a user stack of its own.  A process is its own
+leader.  The shared parts belong to the leader: when the leader is
+deleted while some of its threads remain, it gives up its pid and
+kernel stack at once, and the rest goes with the last thread.
+A thread that dies without being joined stays in the grave until
+the leader is deleted, or execs, and takes it along.
+*/
+
+static struct process *process_alloc()
 {
 	struct process *p;
 
 	p = page_alloc(1);
 
 	p->pid = process_allocate_pid();
-	process_table[p->pid] = p;
-
-	p->pagetable = pagetable_create();
-	pagetable_init(p->pagetable);
+	process_table_set(p->pid, p);
+	list_push_tail(&process_list, &p->all);
 
+	p->leader = p;
+	p->threads = 0;
+	p->released = 0;
 	p->vm_data_size = 0;
 	p->vm_stack_size = 0;
+	p->image = 0;
+	p->slice_ticks = process_quantum;
+	p->woken = 0;
+	p->priority = current ? current->priority : 0;
+	p->level = p->priority;
+	p->interactive = 0;
+	p->sleep_slot = -1;
+	p->cpu = current ? current->cpu : 0;
+	p->lock_depth = 1;
+	p->dying = 0;
+
+	if(process_fpu_enabled) {
+		memcpy(process_fpu_state(p), process_fpu_align(process_fpu_initial), PROCESS_FPU_SIZE);
+	}
 
-	process_data_size_set(p, 2 * PAGE_SIZE);
-	process_stack_size_set(p, 2 * PAGE_SIZE);
-
-	p->kstack = page_alloc(1);
+	p->kstack = process_kstack_alloc();
 	p->kstack_top = p->kstack + PAGE_SIZE - 8;
 	p->kstack_ptr = p->kstack_top - sizeof(struct x86_stack);
+	memset(p->kstack_ptr, 0, sizeof(struct x86_stack));
 
-	process_kstack_reset(p, PROCESS_ENTRY_POINT);
+	return p;
+}
 
-	// XXX table should be allocated
+static struct kobject **process_ktable_create()
+{
+	struct kobject **ktable = kmalloc(sizeof(struct kobject *) * PROCESS_MAX_OBJECTS);
 	int i;
 	for(i = 0; i < PROCESS_MAX_OBJECTS; i++) {
-		p->ktable[i] = 0;
+		ktable[i] = 0;
 	}
+	return ktable;
+}
+
+struct process *process_create()
+{
+	struct process *p = process_alloc();
+
+	p->pagetable = pagetable_create_space();
+	p->ktable = process_ktable_create();
+
+	process_data_size_set(p, 2 * PAGE_SIZE);
+	process_stack_size_set(p, 2 * PAGE_SIZE);
+
+	process_kstack_reset(p, PROCESS_ENTRY_POINT);
 
 	p->state = PROCESS_STATE_RUNNING;
 	printf("%d\n", p->pid);
@@ -224,7 +591,72 @@ struct process *process_create()
 	return p;
 }
 
-void process_delete(struct process *p)
+/*
+Creates a process with an empty address space, for a program
+that is about to be loaded into it: elf_load sets up the data
+segment and the caller gives it a stack, so neither is made here.
+*/
+
+struct process *process_create_empty()
+{
+	struct process *p = process_alloc();
+
+	p->pagetable = pagetable_create_space();
+	p->ktable = process_ktable_create();
+
+	process_kstack_reset(p, PROCESS_ENTRY_POINT);
+
+	return p;
+}
+
+/* Creates a thread of the calling process, to start at entry with the given user stack. */
+
+struct process *process_create_thread(uint32_t entry, uint32_t stack)
+{
+	struct process *leader = current->leader;
+	struct process *p = process_alloc();
+
+	p->leader = leader;
+	process_set_parent(p, current);
+	p->pagetable = leader->pagetable;
+	p->ktable = leader->ktable;
+	leader->threads++;
+
+	process_kstack_reset(p, entry);
+	((struct x86_stack *) p->kstack_ptr)->esp = stack;
+
+	return p;
+}
+
+/*
+A kernel thread runs entry(arg) in kernel mode, with the kernel
+lock held like any other kernel code, until entry returns.
+*/
+
+static void process_kthread_start()
+{
+	smp_kernel_enter();
+	interrupt_unblock();
+	current->kthread_entry(current->kthread_arg);
+	process_exit(0);
+}
+
+struct process *process_create_kthread(void (*entry) (void *), void *arg)
+{
+	struct process *p = process_alloc();
+
+	p->pagetable = pagetable_create_space();
+	p->ktable = process_ktable_create();
+	p->kthread_entry = entry;
+	p->kthread_arg = arg;
+
+	process_kstack_reset_kernel(p, process_kthread_start);
+	process_launch(p);
+
+	return p;
+}
+
+static void process_release(struct process *p)
 {
 	int i;
 	for(i = 0; i < PROCESS_MAX_OBJECTS; i++) {
@@ -232,15 +664,190 @@ void process_delete(struct process *p)
 			kobject_close(p->ktable[i]);
 		}
 	}
+	kfree(p->ktable);
+	if(p->image) {
+		fs_dirent_close(p->image);
+	}
 	pagetable_delete(p->pagetable);
-	page_free(p->kstack);
 	page_free(p);
-	process_table[p->pid] = 0;
 }
 
+/* Leaves p out of the process lists; its children no longer have a parent. */
+
+static void process_unlink(struct process *p)
+{
+	struct list_node *n;
+
+	list_remove(&p->all);
+	if(p->parent) {
+		list_remove(&p->sibling);
+		p->parent = 0;
+	}
+	while((n = p->children.head) || (n = p->zombies.head)) {
+		process_from(n, sibling)->parent = 0;
+		list_remove(n);
+	}
+}
+
+void process_delete(struct process *p)
+{
+	struct process *leader = p->leader;
+
+	process_unlink(p);
+	process_free_pid(p->pid);
+	process_kstack_free(p->kstack);
+
+	if(leader != p) {
+		page_free(p);
+		leader->threads--;
+		if(leader->released && !leader->threads) {
+			process_release(leader);
+		}
+	} else {
+		process_reap_threads(p);
+		if(p->threads) {
+			p->released = 1;
+		} else {
+			process_release(p);
+		}
+	}
+}
+
+static int process_cpu_load(struct cpu *c)
+{
+	int i, n = 0;
+	for(i = 0; i < PROCESS_PRIORITY_LEVELS; i++) {
+		n += list_size(&c->ready_queue[i]);
+	}
+	return n;
+}
+
+static void process_ready_push(struct process *p)
+{
+	struct cpu *c = &cpu_table[p->cpu];
+	list_push_tail(&c->ready_queue[p->level], &p->node);
+	if(c->idling) {
+		smp_reschedule(c);
+	}
+}
+
+/*
+Threads share the pagetable of their leader, and a TLB entry is
+only ever invalidated on the processor that changes the mapping.
+So all the threads of a process are kept on one processor: they
+start where their creator runs, and are neither spread out by
+process_launch nor stolen.  Then at most one of them has the
+pagetable loaded at a time, and process_switch reloads cr3 between
+them.
+*/
+
+static int process_pinned(struct process *p)
+{
+	return p->leader != p || p->threads > 0;
+}
+
+/* Finds the first process ready on c, leaving out pinned ones if stealing. */
+
+static struct process *process_ready_find(struct cpu *c, int steal)
+{
+	struct list_node *n;
+	int i;
+	for(i = 0; i < PROCESS_PRIORITY_LEVELS; i++) {
+		for(n = c->ready_queue[i].head; n; n = n->next) {
+			if(!steal || !process_pinned((struct process *) n))
+				return (struct process *) n;
+		}
+	}
+	return 0;
+}
+
+/* Takes from this processor's queues first, then from the busiest other. */
+
+static struct process *process_ready_pop()
+{
+	struct cpu *self = cpu_self();
+	struct process *p = process_ready_find(self, 0);
+	if(p) {
+		list_remove(&p->node);
+		return p;
+	}
+
+	struct cpu *busiest = 0;
+	int i, most = 0;
+	for(i = 0; i < cpu_count; i++) {
+		int load = process_cpu_load(&cpu_table[i]);
+		if(&cpu_table[i] != self && load > most && process_ready_find(&cpu_table[i], 1)) {
+			busiest = &cpu_table[i];
+			most = load;
+		}
+	}
+	if(!busiest)
+		return 0;
+
+	p = process_ready_find(busiest, 1);
+	list_remove(&p->node);
+	p->cpu = self->index;
+	return p;
+}
+
+/* Returns true if some process ready on this processor runs at level or above. */
+
+static int process_ready_at(int level)
+{
+	struct cpu *c = cpu_self();
+	int i;
+	for(i = 0; i <= level && i < PROCESS_PRIORITY_LEVELS; i++) {
+		if(c->ready_queue[i].head)
+			return 1;
+	}
+	return 0;
+}
+
+static int process_ready_any()
+{
+	struct cpu *self = cpu_self();
+	int i;
+	for(i = 0; i < cpu_count; i++) {
+		if(process_ready_find(&cpu_table[i], &cpu_table[i] != self))
+			return 1;
+	}
+	return 0;
+}
+
+/* A new process starts on the processor with the fewest ready processes, a new thread with its siblings. */
+
 void process_launch(struct process *p)
 {
-	list_push_tail(&ready_list, &p->node);
+	if(process_pinned(p)) {
+		process_ready_push(p);
+		return;
+	}
+
+	int i, least = process_cpu_load(&cpu_table[p->cpu]);
+	for(i = 0; i < cpu_count; i++) {
+		int load = process_cpu_load(&cpu_table[i]);
+		if(load < least) {
+			p->cpu = i;
+			least = load;
+		}
+	}
+	process_ready_push(p);
+}
+
+static void process_latency_record(uint32_t micros)
+{
+	int k = 0;
+
+	// A negative interval is a clock reading taken just before a tick was counted.
+	if(micros > 0x80000000)
+		micros = 0;
+
+	micros >>= 5;
+	while(micros && k < SCHED_LATENCY_BUCKETS - 1) {
+		micros >>= 1;
+		k++;
+	}
+	sched_latency[k]++;
 }
 
 static void process_switch(int newstate)
@@ -248,6 +855,9 @@ static void process_switch(int newstate)
 	interrupt_block();
 
 	if(current) {
+		if(process_fpu_enabled && current->state != PROCESS_STATE_CRADLE) {
+			asm volatile("fxsave (%0)"::"r"(process_fpu_state(current)) : "memory");
+		}
 		if(current->state != PROCESS_STATE_CRADLE) {
 			asm("pushl %ebp");
 			asm("pushl %edi");
@@ -259,31 +869,45 @@ static void process_switch(int newstate)
 		      asm("movl %%esp, %0":"=r"(current->kstack_ptr));
 		}
 
-		interrupt_stack_pointer = (void *) INTERRUPT_STACK_TOP;
-		current->state = newstate;
+		current->lock_depth = cpu_self()->lock_depth;
 
-		if(newstate == PROCESS_STATE_READY) {
-			list_push_tail(&ready_list, &current->node);
+		// Killed by another processor: leave whatever queue it was about to wait in.
+		if(current->dying && newstate != PROCESS_STATE_GRAVE) {
+			list_remove(&current->node);
+			clock_cancel(current);
+			newstate = PROCESS_STATE_GRAVE;
 		}
-		if(newstate == PROCESS_STATE_GRAVE) {
-			list_push_tail(&grave_list, &current->node);
-		}
-	}
 
-	current = 0;
+		current->state = newstate;
 
-	while(1) {
-		current = (struct process *) list_pop_head(&ready_list);
-		if(current)
-			break;
+		if(current == cpu_self()->idle) {
+			// The idle process is never queued: it runs when nothing else can.
+		} else if(newstate == PROCESS_STATE_READY) {
+			process_ready_push(current);
+		} else if(newstate == PROCESS_STATE_GRAVE) {
+			current->dying = 0;
+			process_bury(current);
+		}
+	}
 
-		interrupt_unblock();
-		interrupt_wait();
-		interrupt_block();
+	current = process_ready_pop();
+	if(!current) {
+		current = cpu_self()->idle;
 	}
 
 	current->state = PROCESS_STATE_RUNNING;
-	interrupt_stack_pointer = current->kstack_top;
+	current->slice_ticks = process_quantum << current->level;
+	if(current->woken) {
+		process_latency_record(clock_micros() - current->wakeup_time);
+		current->woken = 0;
+	}
+	sched_switches++;
+	cpu_self()->lock_depth = current->lock_depth;
+	cpu_self()->tss->esp0 = (int32_t) current->kstack_top;
+
+	if(process_fpu_enabled) {
+		asm volatile("fxrstor (%0)"::"r"(process_fpu_state(current)) : "memory");
+	}
 
 	asm("movl %0, %%cr3"::"r"(current->pagetable));
 	asm("movl %0, %%esp"::"r"(current->kstack_ptr));
@@ -301,10 +925,189 @@ static void process_switch(int newstate)
 
 int allow_preempt = 1;
 
+/* Takes the processor away from current, which could have gone on running. */
+
+static void process_switch_preempt()
+{
+	sched_preemptions++;
+	current->stats.involuntary_switches++;
+	process_switch(PROCESS_STATE_READY);
+}
+
 void process_preempt()
 {
-	if(allow_preempt && current && ready_list.head) {
-		process_switch(PROCESS_STATE_READY);
+	if(allow_preempt && current && process_ready_at(PROCESS_PRIORITY_LEVELS - 1)) {
+		process_switch_preempt();
+	}
+}
+
+/*
+Each processor runs its own idle process when it has nothing else
+to do.  It gives up the kernel lock while halted, and wakes up for
+an interrupt, or for a reschedule interrupt when another processor
+makes a process ready.  Idle time is also used to clear pages ahead.
+*/
+
+static void process_idle()
+{
+	struct cpu *c = cpu_self();
+
+	while(1) {
+		smp_kernel_enter();
+
+		if(process_ready_any()) {
+			process_switch(PROCESS_STATE_READY);
+			interrupt_block();
+			smp_kernel_exit();
+			continue;
+		}
+
+		int refilled = page_zero_refill();
+
+		// Announce idling while still holding the lock, so that a process made
+		// ready here after it is dropped comes with a reschedule interrupt.
+		interrupt_block();
+		if(!refilled)
+			c->idling = 1;
+		smp_kernel_exit();
+
+		if(!refilled) {
+			interrupt_wait();
+			interrupt_block();
+			c->idling = 0;
+		}
+	}
+}
+
+struct process *process_create_idle(int cpu)
+{
+	struct process *p = page_alloc(1);
+	if(!p)
+		return 0;
+
+	memset(p, 0, sizeof(*p));
+
+	p->pagetable = pagetable_create();
+	pagetable_init(p->pagetable);
+
+	if(process_fpu_enabled) {
+		memcpy(process_fpu_state(p), process_fpu_align(process_fpu_initial), PROCESS_FPU_SIZE);
+	}
+
+	p->kstack = page_alloc(1);
+	p->kstack_top = p->kstack + PAGE_SIZE - 8;
+	p->kstack_ptr = p->kstack_top - sizeof(struct x86_stack);
+
+	process_kstack_reset_kernel(p, process_idle);
+
+	p->level = PROCESS_PRIORITY_LEVELS - 1;
+	p->sleep_slot = -1;
+	p->cpu = cpu;
+	p->lock_depth = 1;
+
+	return p;
+}
+
+/* Called by each processor other than the first once it is ready to run processes. */
+
+void process_cpu_start()
+{
+	process_switch(PROCESS_STATE_READY);
+}
+
+static void process_boost()
+{
+	struct list_node *n;
+	for(n = process_list.head; n; n = n->next) {
+		struct process *p = process_from(n, all);
+		if(p->level == p->priority)
+			continue;
+		if(p->state == PROCESS_STATE_READY) {
+			list_remove(&p->node);
+			p->level = p->priority;
+			process_ready_push(p);
+		} else {
+			p->level = p->priority;
+		}
+	}
+}
+
+/* Called on every clock tick to charge the running process for it. */
+
+void process_tick()
+{
+	static int boost_ticks = 0;
+
+	// Every processor ticks, but only the first counts out the boost period.
+	if(cpu_self()->index == 0 && ++boost_ticks >= PROCESS_BOOST_TICKS) {
+		boost_ticks = 0;
+		process_boost();
+	}
+
+	if(!current || current == cpu_self()->idle)
+		return;
+
+	// The lock is taken once on entry to this interrupt: more means it came in the kernel.
+	if(cpu_self()->lock_depth > 1) {
+		current->stats.system_ticks++;
+	} else {
+		current->stats.user_ticks++;
+	}
+
+	if(current->dying) {
+		process_switch(PROCESS_STATE_GRAVE);
+		return;
+	}
+
+	current->slice_ticks--;
+	if(current->slice_ticks <= 0) {
+		if(current->level < PROCESS_PRIORITY_LEVELS - 1)
+			current->level++;
+		current->slice_ticks = process_quantum << current->level;
+		if(allow_preempt && process_ready_at(current->level)) {
+			process_switch_preempt();
+		}
+	} else if(allow_preempt && process_ready_at(current->level - 1)) {
+		// A process above this one has woken up.
+		process_switch_preempt();
+	}
+}
+
+/*
+Called for the reschedule interrupt, which another processor sends
+when it makes a process ready here, or kills the running process.
+*/
+
+void process_reschedule()
+{
+	if(!current)
+		return;
+
+	if(current->dying) {
+		process_switch(PROCESS_STATE_GRAVE);
+	} else if(current == cpu_self()->idle) {
+		// The idle loop picks up the new process once the interrupt returns.
+	} else if(allow_preempt && process_ready_at(current->level - 1)) {
+		process_switch_preempt();
+	}
+}
+
+void process_quantum_set(int ticks)
+{
+	if(ticks < 1)
+		ticks = 1;
+	process_quantum = ticks;
+}
+
+void process_sched_stats(struct system_stats *s)
+{
+	int i;
+	s->sched_quantum = process_quantum;
+	s->sched_ticks_per_second = CLICKS_PER_SECOND;
+	s->sched_switches = sched_switches;
+	s->sched_preemptions = sched_preemptions;
+	for(i = 0; i < SCHED_LATENCY_BUCKETS; i++) {
+		s->sched_latency[i] = sched_latency[i];
 	}
 }
 
@@ -312,40 +1115,74 @@ void process_yield()
 {
 	/* no-op if process module not yet initialized. */
 	if(!current) return;
+	current->stats.voluntary_switches++;
 	process_switch(PROCESS_STATE_READY);
 }
 
+/* When a leader exits, its threads go with it; a thread that exits ends only itself. */
+
+static void process_kill_threads(struct process *leader)
+{
+	struct list_node *n;
+	for(n = process_list.head; n; n = n->next) {
+		struct process *p = process_from(n, all);
+		if(p != leader && p->leader == leader && p->state != PROCESS_STATE_GRAVE) {
+			process_make_dead(p);
+		}
+	}
+}
+
 void process_exit(int code)
 {
 	printf("process %d exiting with status %d...\n", current->pid, code); //--> transport to kshell run
+	if(current == current->leader && current->threads) {
+		process_kill_threads(current);
+	}
 	current->exitcode = code;
 	current->exitreason = PROCESS_EXIT_NORMAL;
-	process_wakeup_parent(&grave_watcher_list);	// On exit, wake up parent if need be
 	process_switch(PROCESS_STATE_GRAVE);
 }
 
 void process_wait(struct list *q)
 {
 	list_push_tail(q, &current->node);
+	current->stats.voluntary_switches++;
 	process_switch(PROCESS_STATE_BLOCKED);
 }
+
+/* Like process_wait, but a wait for user input, which earns a boost on wakeup. */
+
+void process_wait_interactive(struct list *q)
+{
+	current->interactive = 1;
+	process_wait(q);
+}
 void active_proc(){  //added by anas
-	for (int i=0; i<PROCESS_MAX_PID; i++){
-		if(process_table[i]){
-			printf("The current active process had the id :\"%d\"\n", process_table[i]->pid);
-		}
+	for (struct list_node *n = process_list.head; n; n = n->next){
+		printf("The current active process had the id :\"%d\"\n", process_from(n, all)->pid);
 	}
 }
 
 
 
+static void process_make_ready(struct process *p)
+{
+	p->state = PROCESS_STATE_READY;
+	p->woken = 1;
+	p->wakeup_time = clock_micros();
+	if(p->interactive) {
+		p->level = p->priority;
+		p->interactive = 0;
+	}
+	process_ready_push(p);
+}
+
 void process_wakeup(struct list *q)
 {
 	struct process *p;
 	p = (struct process *) list_pop_head(q);
 	if(p) {
-		p->state = PROCESS_STATE_READY;
-		list_push_tail(&ready_list, &p->node);
+		process_make_ready(p);
 	}
 }
 
@@ -357,29 +1194,35 @@ void process_reap_all()
 	}
 }
 
-/* Wakes up parent off of the corresponding list*/
-void process_wakeup_parent(struct list *q)
+/* Deletes the dead threads of leader that no one joined. */
+
+void process_reap_threads(struct process *leader)
 {
-	struct process *p = (struct process *) q->head;
-	// Loop through all the waiting parents to see if one needs to be woken up
-	while(p) {
-		if(p->pid == current->ppid && (p->waiting_for_child_pid == 0 || p->waiting_for_child_pid == current->pid)) {
-			p->state = PROCESS_STATE_READY;
-			p->waiting_for_child_pid = 0;
-			list_remove(&p->node);
-			list_push_tail(&ready_list, &p->node);
-			break;
+	struct list_node *n, *next;
+
+	for(n = grave_list.head; n; n = next) {
+		struct process *p = (struct process *) n;
+		next = n->next;
+		if(p != leader && p->leader == leader) {
+			list_remove(n);
+			process_delete(p);
 		}
-		p = (struct process *) (&p->node)->next;
 	}
 }
 
+/* Wakes up p in particular, wherever it is waiting. */
+
+void process_wakeup_one(struct process *p)
+{
+	list_remove(&p->node);
+	process_make_ready(p);
+}
+
 void process_wakeup_all(struct list *q)
 {
 	struct process *p;
 	while((p = (struct process *) list_pop_head(q))) {
-		p->state = PROCESS_STATE_READY;
-		list_push_tail(&ready_list, &p->node);
+		process_make_ready(p);
 	}
 }
 
@@ -425,26 +1268,34 @@ int process_object_max(struct process *p)
 
 void process_make_dead(struct process *dead)
 {
-	int i;
-	for(i = 0; i < PROCESS_MAX_PID; i++) {
-		if(process_table[i] && process_table[i]->ppid == dead->pid) {
-			process_make_dead(process_table[i]);
-		}
+	struct list_node *n, *next;
+
+	if(dead->state == PROCESS_STATE_GRAVE)
+		return;
+
+	for(n = dead->children.head; n; n = next) {
+		next = n->next;
+		process_make_dead(process_from(n, sibling));
 	}
 	dead->exitcode = 0;
 	dead->exitreason = PROCESS_EXIT_KILLED;
 	if(dead == current) {
 		process_switch(PROCESS_STATE_GRAVE);
+	} else if(dead->state == PROCESS_STATE_RUNNING && cpu_table[dead->cpu].running == dead) {
+		// It is running on another processor, which must put it in the grave itself.
+		dead->dying = 1;
+		smp_reschedule(&cpu_table[dead->cpu]);
 	} else {
+		clock_cancel(dead);
 		list_remove(&dead->node);
-		list_push_tail(&grave_list, &dead->node);
+		process_bury(dead);
 	}
 }
 
 int process_kill(uint32_t pid)
 {
-	if(pid > 0 && pid <= PROCESS_MAX_PID) {
-		struct process *dead = process_table[pid];
+	if(pid > 0) {
+		struct process *dead = process_lookup(pid);
 		if(dead) {
 			printf("process killed\n");
 			process_make_dead(dead);
@@ -457,6 +1308,14 @@ int process_kill(uint32_t pid)
 	}
 }
 
+/*
+Waits for the process pid to end, or for any child if pid is zero.
+A dead child is found at the head of the zombie list, and the wait
+sleeps on the queue that the burial of that process will wake.
+A timeout is kept by the clock, which wakes the process out of
+that queue, so that there is no polling.
+*/
+
 int process_wait_child(uint32_t pid, struct process_info *info, int timeout)
 {
 	clock_t start, elapsed;
@@ -467,42 +1326,70 @@ int process_wait_child(uint32_t pid, struct process_info *info, int timeout)
 
 	start = clock_read();
 
-	do {
-		struct process *p = (struct process *) (grave_list.head);
-		while(p) {
-			struct process *next = (struct process *) p->node.next;
-			if((pid != 0 && p->pid == pid) || (p->ppid == current->pid)) {
-				info->exitcode = p->exitcode;
-				info->exitreason = p->exitreason;
-				info->pid = p->pid;
-				return p->pid;
-			}
-			p = next;
+	while(1) {
+		struct process *p;
+		struct list *q;
+
+		if(pid != 0) {
+			p = process_lookup(pid);
+			if(!p)
+				return 0;
+			q = &p->joiners;
+			if(p->state != PROCESS_STATE_GRAVE)
+				p = 0;
+		} else {
+			p = current->zombies.head ? process_from(current->zombies.head, sibling) : 0;
+			q = &current->child_wait;
 		}
 
-		current->waiting_for_child_pid = pid;
-		process_wait(&grave_watcher_list);
-
-		elapsed = clock_diff(start, clock_read());
-		total = elapsed.millis + elapsed.seconds * 1000;
-	} while(total < timeout || timeout < 0);
+		if(p) {
+			info->exitcode = p->exitcode;
+			info->exitreason = p->exitreason;
+			info->pid = p->pid;
+			return p->pid;
+		}
 
-	return 0;
+		if(timeout < 0) {
+			process_wait(q);
+		} else {
+			elapsed = clock_diff(start, clock_read());
+			total = elapsed.millis + elapsed.seconds * 1000;
+			if(total >= timeout)
+				return 0;
+			clock_wait_queue(q, timeout - total);
+		}
+	}
 }
 
-int process_reap(uint32_t pid)
+/*
+Waits for a thread of the same process to end, and reaps it.
+Threads are not reported by process_wait_child, only joined here.
+*/
+
+int process_thread_join(uint32_t tid, struct process_info *info)
 {
-	struct process *p = (struct process *) (grave_list.head);
-	while(p) {
-		struct process *next = (struct process *) p->node.next;
-		if(p->pid == pid) {
-			list_remove(&p->node);
-			process_delete(p);
-			return 0;
+	while(1) {
+		struct process *t = process_lookup(tid);
+		if(!t || t == current || t == t->leader || t->leader != current->leader)
+			return KERROR_NOT_FOUND;
+		if(t->state == PROCESS_STATE_GRAVE) {
+			info->exitcode = t->exitcode;
+			info->exitreason = t->exitreason;
+			info->pid = t->pid;
+			return process_reap(tid) ? KERROR_NOT_FOUND : 0;
 		}
-		p = next;
+		process_wait(&t->joiners);
 	}
-	return 1;
+}
+
+int process_reap(uint32_t pid)
+{
+	struct process *p = process_lookup(pid);
+	if(!p || p->state != PROCESS_STATE_GRAVE)
+		return 1;
+	list_remove(&p->node);
+	process_delete(p);
+	return 0;
 }
 
 /*
@@ -563,9 +1450,58 @@ void process_pass_arguments(struct process *p, int argc, char **argv)
 
 int process_stats(int pid, struct process_stats *s)
 {
-	if(pid > PROCESS_MAX_PID || !process_table[pid]) {
+	struct process *p = process_lookup(pid);
+	if(!p) {
 		return 1;
 	}
-	*s = process_table[pid]->stats;
+	*s = p->stats;
+	s->resident_pages = p->leader->stats.resident_pages;
+	s->peak_resident_pages = p->leader->stats.peak_resident_pages;
+	return 0;
+}
+
+/* Fills in the pids of up to max living processes, and returns how many. */
+
+/*
+Fills in the pids of up to max living processes, and returns how many
+there are in all, so that a caller with too small an array can tell,
+and try again with a larger one.
+*/
+
+int process_list_pids(int *pids, int max)
+{
+	struct list_node *n;
+	int count = 0;
+
+	for(n = process_list.head; n; n = n->next) {
+		struct process *p = process_from(n, all);
+		if(p->state != PROCESS_STATE_GRAVE) {
+			if(count < max)
+				pids[count] = p->pid;
+			count++;
+		}
+	}
+	return count;
+}
+
+int process_set_priority(uint32_t pid, int priority)
+{
+	if(priority < 0 || priority >= PROCESS_PRIORITY_LEVELS)
+		return KERROR_INVALID_REQUEST;
+	struct process *p = pid ? process_lookup(pid) : 0;
+	if(!p)
+		return KERROR_NOT_FOUND;
+
+	interrupt_block();
+	p->priority = priority;
+	if(p->state == PROCESS_STATE_READY) {
+		list_remove(&p->node);
+		p->level = priority;
+		process_ready_push(p);
+	} else {
+		p->level = priority;
+	}
+	interrupt_unblock();
+
 	return 0;
 }
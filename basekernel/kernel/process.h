@@ -22,11 +22,20 @@ See the file LICENSE for details.
 #define PROCESS_STATE_GRAVE   4
 
 #define PROCESS_MAX_OBJECTS 32
-#define PROCESS_MAX_PID 1024
+#define PROCESS_MAX_PID 32768
 
 #define PROCESS_EXIT_NORMAL   0
 #define PROCESS_EXIT_KILLED   1
 
+#define PROCESS_FPU_SIZE 512
+
+#define PROCESS_QUANTUM_DEFAULT 5	// clock ticks, doubled at each lower level
+
+#define PROCESS_PRIORITY_LEVELS 4	// level 0 runs first
+#define PROCESS_BOOST_TICKS 100	// period of raising every process back to its priority
+
+#define PROCESS_MAX_CPUS 8
+
 struct process {
 	struct list_node node;
 	int state;
@@ -36,58 +45,132 @@ struct process {
 	char *kstack;
 	char *kstack_top;
 	char *kstack_ptr;
-	struct kobject *ktable[PROCESS_MAX_OBJECTS];
+	struct kobject **ktable;	// PROCESS_MAX_OBJECTS entries, shared by threads
 	struct process_stats stats;
 	uint32_t pid;
 	uint32_t ppid;
 	uint32_t vm_data_size;
 	uint32_t vm_stack_size;
-	uint32_t waiting_for_child_pid;
+	struct fs_dirent *image;
+	uint32_t image_offset;
+	uint32_t image_vaddr;
+	uint32_t image_length;
+	uint32_t image_text_length;
+	char fpu_area[PROCESS_FPU_SIZE + 16];	// fxsave area, aligned by process_fpu_state
+	int slice_ticks;	// ticks left in the current time slice
+	int woken;	// set when made ready by a wakeup
+	uint32_t wakeup_time;	// clock_micros() at that wakeup
+	int priority;	// highest level of the feedback queue the process may run at
+	int level;	// level of the feedback queue it runs at now
+	int interactive;	// set while blocked waiting for user input
+	uint32_t sleep_deadline;	// clock_micros() at which a sleep ends
+	int sleep_slot;	// slot in the clock's deadline heap, or -1
+	int cpu;	// processor it last ran on, whose ready queue it joins
+	int lock_depth;	// kernel lock nesting saved by process_switch
+	int dying;	// killed while running on another processor
+	struct process *leader;	// owner of the pagetable and ktable; itself unless a thread
+	int threads;	// of a leader, the number of its threads not yet deleted
+	int released;	// of a leader, deleted but still holding the shared parts for its threads
+	struct list joiners;	// waiting for this one to end, by pid or in process_thread_join
+	void (*kthread_entry) (void *);
+	void *kthread_arg;
+	struct process *parent;	// living parent, or null
+	struct list_node sibling;	// on the children or zombies list of the parent
+	struct list children;	// living children
+	struct list zombies;	// dead children not yet reaped
+	struct list child_wait;	// waiting for any child to end
+	struct list_node all;	// on the list of all processes
+};
+
+/*
+Each processor has its own running process, idle process, and
+ready queues.  cpu_self finds the structure of the processor it
+runs on through %gs, which every kernel entry loads with a
+segment based at that structure.
+*/
+
+struct cpu {
+	struct cpu *self;	// must come first, for cpu_self
+	int index;
+	int apic_id;
+	volatile int started;
+	int idling;	// halted in the idle loop
+	int lock_depth;	// nesting of kernel entries holding the kernel lock
+	struct process *running;
+	struct process *idle;
+	struct x86_tss *tss;
+	struct list ready_queue[PROCESS_PRIORITY_LEVELS];
 };
 
+static inline struct cpu *cpu_self()
+{
+	struct cpu *c;
+	asm volatile("movl %%gs:0, %0" : "=r"(c));
+	return c;
+}
+
+#define current (cpu_self()->running)
+
+extern struct cpu cpu_table[PROCESS_MAX_CPUS];
+extern int cpu_count;
+
 void process_init();
-extern struct process *current;
-extern struct list ready_list;
 extern struct list grave_list;
-extern struct list grave_watcher_list;
-extern struct process *process_table[PROCESS_MAX_PID];
+struct process *process_lookup(uint32_t pid);
 struct process *process_create();
+struct process *process_create_empty();
+struct process *process_create_idle(int cpu);
+struct process *process_create_thread(uint32_t entry, uint32_t stack);
+struct process *process_create_kthread(void (*entry) (void *), void *arg);
+int process_thread_join(uint32_t tid, struct process_info *info);
+void process_cpu_start();
+void process_fpu_cpu_init();
 void process_delete(struct process *p);
 void process_launch(struct process *p);
 void process_pass_arguments(struct process *p, int argc, char **argv);
 void process_inherit(struct process *parent, struct process *child);
 void process_selective_inherit(struct process *parent, struct process *child, int * fds, int fd_len);
 void active_proc(); //added by anas
-extern struct process *process_table[PROCESS_MAX_PID];
-extern struct process *current;
-extern struct list ready_list;
 void process_stack_reset(struct process *p, unsigned size);
 void process_kstack_reset(struct process *p, unsigned entry_point);
 void process_kstack_copy(struct process *parent, struct process *child);
+void process_fpu_copy(struct process *parent, struct process *child);
 void ready_traverse(struct list *readylist);
+void process_resident_add(struct process *p, int pages);
 int process_data_size_set(struct process *p, unsigned size);
 int process_stack_size_set(struct process *p, unsigned size);
+void process_image_set(struct process *p, struct fs_dirent *d, uint32_t offset, uint32_t vaddr, uint32_t length, uint32_t text_length);
+int process_image_contains(struct process *p, unsigned vaddr);
+int process_image_fault(struct process *p, unsigned vaddr);
 
 int process_available_fd(struct process *p);
 int process_object_max(struct process *p);
 
 void process_yield();
 void process_preempt();
+void process_tick();
+void process_reschedule();
+void process_quantum_set(int ticks);
+void process_sched_stats(struct system_stats *s);
 void process_exit(int code);
 void process_dump(struct process *p);
 
 void process_wait(struct list *q);
+void process_wait_interactive(struct list *q);
 void process_wakeup(struct list *q);
-void process_wakeup_parent(struct list *q);
 void process_wakeup_all(struct list *q);
+void process_wakeup_one(struct process *p);
 void process_reap_all();
+void process_reap_threads(struct process *leader);
 
 int process_kill(uint32_t pid);
+void process_make_dead(struct process *dead);
 int process_wait_child(uint32_t pid, struct process_info *info, int timeout);
 int process_reap(uint32_t pid);
 
 int process_stats(int pid, struct process_stats *stat);
+int process_list_pids(int *pids, int max);
+int process_set_priority(uint32_t pid, int priority);
 
-extern struct process *current;
 
 #endif
@@ -0,0 +1,144 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "slab.h"
+#include "page.h"
+#include "kmalloc.h"
+#include "console.h"
+#include "kernel/types.h"
+
+/*
+Each slab is exactly one page, so the slab that owns an object
+is found by rounding the object address down to a page boundary.
+Slabs move between the full, partial, and empty lists of the
+cache as objects come and go.  One empty slab is kept in reserve
+so that a cache which oscillates around a slab boundary does not
+continually allocate and release pages.
+*/
+
+#define KMEM_ALIGN 8
+
+struct kmem_slab {
+	struct list_node node;
+	struct kmem_cache *cache;
+	void *free;
+	int inuse;
+};
+
+#define KMEM_SLAB_HEADER ((sizeof(struct kmem_slab) + KMEM_ALIGN - 1) & ~(KMEM_ALIGN - 1))
+
+struct kmem_cache *kmem_cache_create(const char *name, int size)
+{
+	struct kmem_cache *c = kmalloc(sizeof(*c));
+	if(!c) return 0;
+
+	struct kmem_cache init = KMEM_CACHE_INIT(name, size);
+	*c = init;
+	return c;
+}
+
+static struct kmem_slab *kmem_slab_create(struct kmem_cache *c)
+{
+	struct kmem_slab *s = page_alloc(0);
+	if(!s) return 0;
+
+	s->cache = c;
+	s->inuse = 0;
+	s->free = 0;
+
+	char *object = (char *) s + KMEM_SLAB_HEADER;
+	int i;
+	for(i = 0; i < c->objects_per_slab; i++) {
+		*(void **) object = s->free;
+		s->free = object;
+		object += c->object_size;
+	}
+
+	c->slabs++;
+	return s;
+}
+
+static void kmem_slab_move(struct kmem_slab *s, struct list *l)
+{
+	list_remove(&s->node);
+	list_push_head(l, &s->node);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c)
+{
+	struct kmem_slab *s;
+
+	if(!c->objects_per_slab) {
+		// First use of a statically initialized cache.
+		c->object_size = MAX(c->object_size, sizeof(void *));
+		c->object_size = (c->object_size + KMEM_ALIGN - 1) & ~(KMEM_ALIGN - 1);
+		c->objects_per_slab = (PAGE_SIZE - KMEM_SLAB_HEADER) / c->object_size;
+		if(c->objects_per_slab < 1) {
+			printf("kmem_cache: %s objects are too large (%d bytes)\n", c->name, c->object_size);
+			return 0;
+		}
+	}
+
+	if(c->partial.head) {
+		s = (struct kmem_slab *) c->partial.head;
+	} else if(c->empty.head) {
+		s = (struct kmem_slab *) c->empty.head;
+		kmem_slab_move(s, &c->partial);
+	} else {
+		s = kmem_slab_create(c);
+		if(!s) return 0;
+		list_push_head(&c->partial, &s->node);
+	}
+
+	void *object = s->free;
+	s->free = *(void **) object;
+	s->inuse++;
+	c->objects_in_use++;
+
+	if(s->inuse == c->objects_per_slab) {
+		kmem_slab_move(s, &c->full);
+	}
+
+	return object;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *ptr)
+{
+	if(!ptr) return;
+
+	struct kmem_slab *s = (struct kmem_slab *) ((addr_t) ptr & PAGE_MASK);
+	if(s->cache != c) {
+		printf("kmem_cache: invalid free(%x) to cache %s\n", ptr, c->name);
+		return;
+	}
+
+	if(s->inuse == c->objects_per_slab) {
+		kmem_slab_move(s, &c->partial);
+	}
+
+	*(void **) ptr = s->free;
+	s->free = ptr;
+	s->inuse--;
+	c->objects_in_use--;
+
+	if(s->inuse == 0) {
+		if(c->empty.head) {
+			list_remove(&s->node);
+			s->cache = 0;
+			page_free(s);
+			c->slabs--;
+		} else {
+			kmem_slab_move(s, &c->empty);
+		}
+	}
+}
+
+void kmem_cache_debug(struct kmem_cache *c)
+{
+	printf("%s: %d objects of %d bytes in use, %d slabs (%d full %d partial %d empty)\n",
+		c->name, c->objects_in_use, c->object_size, c->slabs,
+		list_size(&c->full), list_size(&c->partial), list_size(&c->empty));
+}
@@ -0,0 +1,77 @@
+/****************************************************************
+* Copyright (C) 2016-2019 The University of Notre Dame
+* This software is distributed under the GNU General Public License.
+* See the file LICENSE for details.
+*****************************************************************/
+/**
+ * @file slab.h
+ * @brief Object cache allocator for fixed-size kernel objects
+ *
+ * A kmem_cache hands out objects of a single size, carved from whole
+ * pages obtained with page_alloc(). Each page (a slab) begins with a
+ * small header followed by as many objects as fit, and keeps its free
+ * objects on a singly linked list threaded through the objects themselves.
+ * Allocation and release are constant time, and frequently created kernel
+ * objects no longer fragment the kmalloc arena.
+ *
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "list.h"
+
+struct kmem_cache {
+	const char *name;
+	int object_size;
+	int objects_per_slab;
+	struct list partial;
+	struct list full;
+	struct list empty;
+	int slabs;
+	int objects_in_use;
+};
+
+/**
+ * @brief Static initializer for a kmem_cache
+ *
+ * Allows a module to declare its cache as a static variable, so that it
+ * is usable without an explicit initialization step at boot.
+ */
+#define KMEM_CACHE_INIT(name,size) {name,size,0,LIST_INIT,LIST_INIT,LIST_INIT,0,0}
+
+/**
+ * @brief Creates a new object cache
+ *
+ * @param name is a descriptive name for debugging output
+ * @param size is the size in bytes of each object, at most a page less the slab header
+ * @return a pointer to the new cache, or zero on failure
+ */
+struct kmem_cache *kmem_cache_create(const char *name, int size);
+
+/**
+ * @brief Allocates one object from a cache
+ *
+ * The contents of the object are not cleared.
+ *
+ * @param c is the cache to allocate from
+ * @return a pointer to the object, or zero if no page could be obtained
+ */
+void *kmem_cache_alloc(struct kmem_cache *c);
+
+/**
+ * @brief Returns an object to the cache it came from
+ *
+ * @param c is the cache the object was allocated from
+ * @param ptr is the object to be released
+ */
+void kmem_cache_free(struct kmem_cache *c, void *ptr);
+
+/**
+ * @brief Outputs the state of an object cache
+ *
+ * @param c is the cache to be described
+ */
+void kmem_cache_debug(struct kmem_cache *c);
+
+#endif
@@ -0,0 +1,462 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#include "smp.h"
+#include "apic.h"
+#include "ioapic.h"
+#include "ioports.h"
+#include "spinlock.h"
+#include "interrupt.h"
+#include "process.h"
+#include "pagetable.h"
+#include "page.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "clock.h"
+#include "kernelcore.h"
+#include "memorylayout.h"
+#include "x86.h"
+
+/*
+The kernel runs on several processors under one big kernel lock.
+A processor takes the lock when it enters the kernel from user
+mode or from its idle loop, and gives it back when it leaves, so
+that user code runs in parallel but kernel code never does, and
+the interrupt_block() style of mutual exclusion stays valid.
+lock_depth counts the nested kernel entries of the running context;
+process_switch saves and restores it with each process, because a
+process may leave the processor at one depth and come back at another.
+*/
+
+static struct spinlock kernel_lock = SPINLOCK_INIT;
+
+void smp_kernel_enter()
+{
+	struct cpu *c = cpu_self();
+	if(c->lock_depth++ == 0) {
+		spinlock_acquire(&kernel_lock);
+	}
+}
+
+void smp_kernel_exit()
+{
+	struct cpu *c = cpu_self();
+	if(--c->lock_depth == 0) {
+		spinlock_release(&kernel_lock);
+	}
+}
+
+/*
+The MP floating pointer structure and configuration table, as left
+by the BIOS, list the processors and I/O APICs of the machine.
+*/
+
+struct mp_floating {
+	char signature[4];
+	uint32_t config;
+	uint8_t length;
+	uint8_t version;
+	uint8_t checksum;
+	uint8_t type;
+	uint8_t imcr;
+	uint8_t reserved[3];
+};
+
+struct mp_config {
+	char signature[4];
+	uint16_t length;
+	uint8_t version;
+	uint8_t checksum;
+	char product[20];
+	uint32_t oem_table;
+	uint16_t oem_length;
+	uint16_t entries;
+	uint32_t apic_address;
+	uint16_t ext_length;
+	uint8_t ext_checksum;
+	uint8_t reserved;
+};
+
+struct mp_processor {
+	uint8_t type;
+	uint8_t apic_id;
+	uint8_t apic_version;
+	uint8_t flags;
+	uint32_t signature;
+	uint32_t features;
+	uint32_t reserved[2];
+};
+
+struct mp_bus {
+	uint8_t type;
+	uint8_t id;
+	char name[6];
+};
+
+struct mp_ioapic {
+	uint8_t type;
+	uint8_t id;
+	uint8_t version;
+	uint8_t flags;
+	uint32_t address;
+};
+
+struct mp_interrupt {
+	uint8_t type;
+	uint8_t irq_type;
+	uint16_t flags;
+	uint8_t bus;
+	uint8_t bus_irq;
+	uint8_t ioapic;
+	uint8_t pin;
+};
+
+#define MP_PROCESSOR 0
+#define MP_BUS       1
+#define MP_IOAPIC    2
+#define MP_INTERRUPT 3
+
+#define MP_IRQ_INT   0
+
+// Polarity and trigger mode in the flags of an interrupt entry.
+#define MP_ACTIVE_LOW 0x3
+#define MP_LEVEL      0xc
+
+// If set in the imcr byte, the IMCR must be switched to leave PIC mode.
+#define MP_IMCR_PRESENT 0x80
+#define IMCR_SELECT 0x22
+#define IMCR_DATA   0x23
+
+#define MP_PROCESSOR_ENABLED 1
+#define MP_PROCESSOR_BOOT    2
+
+#define SMP_PERCPU_SEGMENT 6
+#define SMP_GDT_ENTRIES    7
+
+struct gdt_pointer {
+	uint16_t limit;
+	uint32_t base;
+};
+
+extern struct x86_segment gdt[];
+extern struct x86_tss tss;
+extern char smp_trampoline[];
+extern char smp_trampoline_end[];
+
+// Read by smp_start32 in kernelcore.S, for the processor being started.
+uint32_t smp_boot_stack = 0;
+static struct cpu *smp_booting = 0;
+
+static struct x86_segment *smp_gdt[PROCESS_MAX_CPUS];
+
+static uint32_t ioapic_address = 0;
+static int ioapic_id = 0;
+
+/*
+The pin and flags of each ISA interrupt at the I/O APIC.
+They are the same as the IRQ unless the MP table says otherwise,
+as it usually does for the timer.
+*/
+
+static int isa_pin[16];
+static int isa_flags[16];
+static uint32_t isa_buses = 0;
+
+static int mp_checksum(const uint8_t *p, int length)
+{
+	uint8_t sum = 0;
+	while(length-- > 0) {
+		sum += *p++;
+	}
+	return sum;
+}
+
+static struct mp_floating *mp_search(uint32_t start, uint32_t length)
+{
+	uint32_t a;
+	for(a = start; a < start + length; a += 16) {
+		struct mp_floating *f = (struct mp_floating *) a;
+		if(!strncmp(f->signature, "_MP_", 4) && !mp_checksum((uint8_t *) f, sizeof(*f))) {
+			return f;
+		}
+	}
+	return 0;
+}
+
+static struct mp_floating *mp_find()
+{
+	struct mp_floating *f;
+
+	// First the extended BIOS data area, then the last KB of base memory, then the BIOS ROM.
+	uint32_t ebda = *(uint16_t *) 0x40e << 4;
+	if(ebda && (f = mp_search(ebda, 1024)))
+		return f;
+
+	uint32_t base = *(uint16_t *) 0x413 * 1024;
+	if(base && (f = mp_search(base - 1024, 1024)))
+		return f;
+
+	return mp_search(0xf0000, 0x10000);
+}
+
+static void segment_set(struct x86_segment *s, uint32_t base, uint32_t limit, int type, int stype, int granularity)
+{
+	s->limit0 = limit & 0xffff;
+	s->limit1 = (limit >> 16) & 0xf;
+	s->base0 = base & 0xffff;
+	s->base1 = (base >> 16) & 0xff;
+	s->base2 = (base >> 24) & 0xff;
+	s->type = type;
+	s->stype = stype;
+	s->dpl = 0;
+	s->present = 1;
+	s->avail = 0;
+	s->zero = 0;
+	s->size = 1;
+	s->granularity = granularity;
+}
+
+static void smp_load_segments(struct x86_segment *table, int load_tss)
+{
+	struct gdt_pointer p;
+	p.limit = SMP_GDT_ENTRIES * sizeof(struct x86_segment) - 1;
+	p.base = (uint32_t) table;
+	asm volatile("lgdt %0" : : "m"(p));
+	if(load_tss) {
+		asm volatile("ltr %w0" : : "r"(X86_SEGMENT_TSS));
+	}
+	asm volatile("movw %w0, %%gs" : : "r"(X86_SEGMENT_SELECTOR(SMP_PERCPU_SEGMENT, 0)));
+}
+
+static void smp_cpu_setup(struct cpu *c, int index)
+{
+	int i;
+	c->self = c;
+	c->index = index;
+	c->lock_depth = 0;
+	for(i = 0; i < PROCESS_PRIORITY_LEVELS; i++) {
+		c->ready_queue[i].head = c->ready_queue[i].tail = 0;
+		c->ready_queue[i].size = 0;
+	}
+}
+
+/*
+Called first thing in kernel_main, before any interrupt, so that
+cpu_self works on the boot processor.  The boot context holds the
+kernel lock from here on, like any other context in the kernel.
+*/
+
+void smp_boot_init()
+{
+	struct cpu *c = &cpu_table[0];
+	smp_cpu_setup(c, 0);
+	c->tss = &tss;
+
+	segment_set(&gdt[SMP_PERCPU_SEGMENT], (uint32_t) c, sizeof(*c) - 1, 2, 1, 0);
+	smp_load_segments(gdt, 0);
+
+	smp_kernel_enter();
+}
+
+static void smp_timer_interrupt(int i, int code)
+{
+	clock_apic_tick();
+}
+
+static void smp_reschedule_interrupt(int i, int code)
+{
+	process_reschedule();
+}
+
+void smp_reschedule(struct cpu *c)
+{
+	if(c != cpu_self() && apic_present()) {
+		apic_send_ipi(c->apic_id, APIC_RESCHEDULE_VECTOR);
+	}
+}
+
+/* Entered from smp_start32 in kernelcore.S, on the boot stack of the new processor. */
+
+void smp_ap_main()
+{
+	struct cpu *c = smp_booting;
+
+	smp_load_segments(smp_gdt[c->index], 1);
+
+	pagetable_load(c->idle->pagetable);
+	pagetable_enable();
+	process_fpu_cpu_init();
+
+	apic_cpu_init(0);
+	apic_timer_start(APIC_TIMER_VECTOR, CLICKS_PER_SECOND);
+
+	c->started = 1;
+
+	smp_kernel_enter();
+	process_cpu_start();
+}
+
+static int smp_start_cpu(int index, int apic)
+{
+	struct cpu *c = &cpu_table[index];
+
+	// A copy of the GDT, followed by the TSS it refers to, fills one page.
+	struct x86_segment *table = page_alloc(1);
+	char *stack = page_alloc(1);
+	if(!table || !stack)
+		return 0;
+
+	struct x86_tss *t = (struct x86_tss *) (table + SMP_GDT_ENTRIES);
+	t->ss0 = X86_SEGMENT_KERNEL_DATA;
+	t->iomap = sizeof(*t);
+
+	memcpy(table, gdt, SMP_GDT_ENTRIES * sizeof(struct x86_segment));
+	segment_set(&table[5], (uint32_t) t, sizeof(*t) - 1, 9, 0, 0);
+	segment_set(&table[SMP_PERCPU_SEGMENT], (uint32_t) c, sizeof(*c) - 1, 2, 1, 0);
+	smp_gdt[index] = table;
+
+	smp_cpu_setup(c, index);
+	c->apic_id = apic;
+	c->tss = t;
+	c->started = 0;
+	c->idle = process_create_idle(index);
+	if(!c->idle)
+		return 0;
+
+	smp_boot_stack = (uint32_t) stack + PAGE_SIZE - 16;
+	smp_booting = c;
+
+	apic_start_cpu(apic, SMP_TRAMPOLINE);
+
+	uint32_t start = clock_micros();
+	while(!c->started && clock_micros() - start < 100000) {
+		asm volatile("pause");
+	}
+	return c->started;
+}
+
+/*
+Route the ISA interrupts through the I/O APIC to the boot processor,
+and have interrupt.c take them from there instead of from the PIC.
+A machine whose IMCR still connects the PIC straight to the boot
+processor must first be switched over to symmetric mode.
+*/
+
+static void smp_ioapic_init(struct mp_floating *f)
+{
+	int i;
+
+	if(!ioapic_address)
+		return;
+
+	// The cascade from the second PIC has no use here.
+	isa_pin[2] = -1;
+
+	if(f->imcr & MP_IMCR_PRESENT) {
+		outb(0x70, IMCR_SELECT);
+		outb(0x01, IMCR_DATA);
+	}
+
+	ioapic_init(ioapic_address);
+	for(i = 0; i < 16; i++) {
+		ioapic_route(isa_pin[i], 32 + i, isa_flags[i], cpu_table[0].apic_id);
+	}
+	interrupt_use_ioapic(isa_pin);
+}
+
+/*
+Find the other processors in the MP table, and start each of them.
+Without an MP table the kernel runs on the boot processor alone.
+*/
+
+void smp_init()
+{
+	struct mp_floating *f = mp_find();
+	if(!f || !f->config) {
+		printf("smp: no mp table, running on one cpu\n");
+		return;
+	}
+
+	struct mp_config *config = (struct mp_config *) f->config;
+	if(strncmp(config->signature, "PCMP", 4) || mp_checksum((uint8_t *) config, config->length)) {
+		printf("smp: invalid mp table, running on one cpu\n");
+		return;
+	}
+
+	apic_init(config->apic_address);
+	apic_cpu_init(1);
+	cpu_table[0].apic_id = apic_id();
+
+	interrupt_register(APIC_TIMER_VECTOR, smp_timer_interrupt);
+	interrupt_register(APIC_RESCHEDULE_VECTOR, smp_reschedule_interrupt);
+
+	memcpy((void *) SMP_TRAMPOLINE, smp_trampoline, smp_trampoline_end - smp_trampoline);
+
+	uint8_t *entry = (uint8_t *) (config + 1);
+	int i;
+	for(i = 0; i < 16; i++) {
+		isa_pin[i] = i;
+		isa_flags[i] = 0;
+	}
+	for(i = 0; i < config->entries; i++) {
+		if(*entry == MP_PROCESSOR) {
+			struct mp_processor *p = (struct mp_processor *) entry;
+			if((p->flags & MP_PROCESSOR_ENABLED) && !(p->flags & MP_PROCESSOR_BOOT)) {
+				if(cpu_count >= PROCESS_MAX_CPUS) {
+					printf("smp: ignoring cpu %d beyond %d cpus\n", p->apic_id, PROCESS_MAX_CPUS);
+				} else if(smp_start_cpu(cpu_count, p->apic_id)) {
+					cpu_count++;
+				} else {
+					printf("smp: cpu %d did not start\n", p->apic_id);
+				}
+			}
+			entry += sizeof(struct mp_processor);
+		} else if(*entry == MP_BUS) {
+			struct mp_bus *b = (struct mp_bus *) entry;
+			if(b->id < 32 && !strncmp(b->name, "ISA", 3))
+				isa_buses |= 1 << b->id;
+			entry += sizeof(struct mp_bus);
+		} else if(*entry == MP_IOAPIC) {
+			struct mp_ioapic *io = (struct mp_ioapic *) entry;
+			if(!ioapic_address) {
+				ioapic_address = io->address;
+				ioapic_id = io->id;
+			}
+			entry += sizeof(struct mp_ioapic);
+		} else if(*entry == MP_INTERRUPT) {
+			struct mp_interrupt *in = (struct mp_interrupt *) entry;
+			if(in->irq_type == MP_IRQ_INT && in->bus < 32 && (isa_buses & (1 << in->bus)) && in->bus_irq < 16 && in->ioapic == ioapic_id) {
+				isa_pin[in->bus_irq] = in->pin;
+				isa_flags[in->bus_irq] = 0;
+				if((in->flags & MP_ACTIVE_LOW) == MP_ACTIVE_LOW)
+					isa_flags[in->bus_irq] |= IOAPIC_ACTIVE_LOW;
+				if((in->flags & MP_LEVEL) == MP_LEVEL)
+					isa_flags[in->bus_irq] |= IOAPIC_LEVEL;
+			}
+			entry += sizeof(struct mp_interrupt);
+		} else {
+			entry += 8;
+		}
+	}
+
+	printf("smp: %d cpus running\n", cpu_count);
+
+	smp_ioapic_init(f);
+
+	// The boot processor takes its scheduler tick from its own APIC timer too.
+	apic_timer_start(APIC_TIMER_VECTOR, CLICKS_PER_SECOND);
+	clock_apic_start();
+}
+
+int smp_cpu_count()
+{
+	return cpu_count;
+}
+
+uint32_t smp_ioapic_address()
+{
+	return ioapic_address;
+}
@@ -0,0 +1,23 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef SMP_H
+#define SMP_H
+
+#include "kernel/types.h"
+#include "process.h"
+
+void smp_boot_init();
+void smp_init();
+int  smp_cpu_count();
+uint32_t smp_ioapic_address();
+
+void smp_kernel_enter();
+void smp_kernel_exit();
+
+void smp_reschedule(struct cpu *c);
+
+#endif
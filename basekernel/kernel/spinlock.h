@@ -0,0 +1,44 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "kernel/types.h"
+
+/*
+A spinlock guards data shared between processors for a short time.
+It does not block interrupts: a caller that may also be interrupted
+by a user of the same lock must block interrupts first.
+*/
+
+struct spinlock {
+	volatile uint32_t locked;
+};
+
+#define SPINLOCK_INIT {0}
+
+static inline void spinlock_acquire(struct spinlock *l)
+{
+	uint32_t old;
+	while(1) {
+		old = 1;
+		asm volatile("xchgl %0, %1" : "+r"(old), "+m"(l->locked) : : "memory");
+		if(!old)
+			return;
+		while(l->locked) {
+			asm volatile("pause");
+		}
+	}
+}
+
+static inline void spinlock_release(struct spinlock *l)
+{
+	asm volatile("" : : : "memory");
+	l->locked = 0;
+}
+
+#endif
@@ -188,13 +188,33 @@ int str2int(const char *s, int *d)
 	return 1;
 }
 
+/*
+memset and memcpy align the destination to a word boundary
+a byte at a time, move whole words with rep stosl / rep movsl,
+and finish the last few bytes one at a time.  The kernel does
+not use SSE, so that it never has to save the user's SSE state
+on entry.
+*/
+
 void memset(void *vd, char value, unsigned length)
 {
 	char *d = vd;
+
+	while(length && ((addr_t) d & 3)) {
+		*d++ = value;
+		length--;
+	}
+
+	if(length >= 4) {
+		uint32_t word = (uint8_t) value * 0x01010101;
+		unsigned words = length / 4;
+		asm volatile("cld; rep stosl" : "+D"(d), "+c"(words) : "a"(word) : "memory");
+		length %= 4;
+	}
+
 	while(length) {
-		*d = value;
+		*d++ = value;
 		length--;
-		d++;
 	}
 }
 
@@ -202,10 +222,20 @@ void memcpy(void *vd, const void *vs, unsigned length)
 {
 	char *d = vd;
 	const char *s = vs;
+
+	while(length && ((addr_t) d & 3)) {
+		*d++ = *s++;
+		length--;
+	}
+
+	if(length >= 4) {
+		unsigned words = length / 4;
+		asm volatile("cld; rep movsl" : "+D"(d), "+S"(s), "+c"(words) : : "memory");
+		length %= 4;
+	}
+
 	while(length) {
-		*d = *s;
-		d++;
-		s++;
+		*d++ = *s++;
 		length--;
 	}
 }
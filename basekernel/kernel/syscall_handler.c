@@ -97,11 +97,18 @@ static void argv_delete(int argc, char **argv)
 process_run() creates a child process in a more efficient
 way than fork/exec by creating the child without duplicating
 the memory state, then loading
+
+process_spawn() is the common path of run and wrun.  The child
+gets an empty address space, from a pool of spare pagetables,
+and a single stack page, and its objects are copied directly
+from the parent: all of them, or those named in fds, where
+fds[i] gives the parent object that becomes object i of the child.
 */
 
-int sys_process_run( int fd, int argc, const char **argv)
+static int process_spawn( int fd, int argc, const char **argv, int *fds, int fd_len)
 {
 	if(!is_valid_object_type(fd,KOBJECT_FILE)) return KERROR_INVALID_OBJECT;
+	if(fds && (fd_len < 0 || fd_len > PROCESS_MAX_OBJECTS)) return KERROR_INVALID_REQUEST;
 
 	struct kobject *k = current->ktable[fd];
 
@@ -109,8 +116,12 @@ int sys_process_run( int fd, int argc, const char **argv)
 	char **copy_argv = argv_copy(argc, argv);
 
 	/* Create the child process */
-	struct process *p = process_create();
-	process_inherit(current, p);
+	struct process *p = process_create_empty();
+	if(fds) {
+		process_selective_inherit(current, p, fds, fd_len);
+	} else {
+		process_inherit(current, p);
+	}
 
 	/* SWITCH TO ADDRESS SPACE OF CHILD PROCESS */
 	struct pagetable *old_pagetable = current->pagetable;
@@ -121,8 +132,8 @@ int sys_process_run( int fd, int argc, const char **argv)
 	addr_t entry;
 	int r = elf_load(p, k->data.file, &entry);
 	if(r >= 0) {
-		/* If load succeeded, reset stack and pass arguments */
-		process_stack_reset(p, PAGE_SIZE);
+		/* If load succeeded, give it a fresh stack and pass arguments */
+		process_stack_size_set(p, PAGE_SIZE);
 		process_kstack_reset(p, entry);
 		process_pass_arguments(p, argc, copy_argv);
 	}
@@ -136,9 +147,7 @@ int sys_process_run( int fd, int argc, const char **argv)
 
 	/* If any error happened, return in the context of the parent */
 	if(r < 0) {
-		if(r == KERROR_EXECUTION_FAILED) {
-			process_delete(p);
-		}
+		process_delete(p);
 		return r;
 	}
 
@@ -147,53 +156,16 @@ int sys_process_run( int fd, int argc, const char **argv)
 	return p->pid;
 }
 
+int sys_process_run( int fd, int argc, const char **argv)
+{
+	return process_spawn(fd, argc, argv, 0, 0);
+}
+
 /* Function creates a child process with the standard window replaced by wd */
 int sys_process_wrun( int fd, int argc, const char **argv, int *fds, int fd_len)
 {
-	if(!is_valid_object_type(fd,KOBJECT_FILE)) return KERROR_INVALID_OBJECT;
-	struct kobject *k = current->ktable[fd];
-
-	/* Copy argv array into kernel memory. */
-	char **copy_argv = argv_copy(argc, argv);
-
-	/* Create the child process */
-	struct process *p = process_create();
-
-	process_selective_inherit(current, p, fds, fd_len);
-
-	/* SWITCH TO ADDRESS SPACE OF CHILD PROCESS */
-	struct pagetable *old_pagetable = current->pagetable;
-	current->pagetable = p->pagetable;
-	pagetable_load(p->pagetable);
-
-	/* Attempt to load the program image. */
-	addr_t entry;
-	int r = elf_load(p, k->data.file, &entry);
-	if(r >= 0) {
-		/* If load succeeded, reset stack and pass arguments */
-		process_stack_reset(p, PAGE_SIZE);
-		process_kstack_reset(p, entry);
-		process_pass_arguments(p, argc, copy_argv);
-	}
-
-	/* SWITCH BACK TO ADDRESS SPACE OF PARENT PROCESS */
-	current->pagetable = old_pagetable;
-	pagetable_load(old_pagetable);
-
-	/* Delete the argument copy. */
-	argv_delete(argc, copy_argv);
-
-	/* If any error happened, return in the context of the parent */
-	if(r < 0) {
-		if(r == KERROR_EXECUTION_FAILED) {
-			process_delete(p);
-		}
-		return r;
-	}
-
-	/* Otherwise, launch the new child process. */
-	process_launch(p);
-	return p->pid;
+	if(!fds) return KERROR_INVALID_REQUEST;
+	return process_spawn(fd, argc, argv, fds, fd_len);
 }
 
 int sys_process_exec( int fd, int argc, const char **argv)
@@ -203,6 +175,11 @@ int sys_process_exec( int fd, int argc, const char **argv)
 
 	addr_t entry;
 
+	/* Other threads would be left running in the old image. */
+	if(current->leader != current) return KERROR_INVALID_REQUEST;
+	process_reap_threads(current);
+	if(current->threads) return KERROR_INVALID_REQUEST;
+
 	/* Duplicate the arguments into kernel space */
 	char **copy_argv = argv_copy(argc, argv);
 
@@ -245,8 +222,15 @@ int sys_process_fork()
 	p->ppid = current->pid;
 	pagetable_delete(p->pagetable);
 	p->pagetable = pagetable_duplicate(current->pagetable);
+	pagetable_refresh();
+	struct process *leader = current->leader;
+	p->vm_data_size = leader->vm_data_size;
+	p->vm_stack_size = leader->vm_stack_size;
+	p->stats.resident_pages = p->stats.peak_resident_pages = leader->stats.resident_pages;
+	process_image_set(p, leader->image, leader->image_offset, leader->image_vaddr, leader->image_length, leader->image_text_length);
 	process_inherit(current, p);
 	process_kstack_copy(current, p);
+	process_fpu_copy(current, p);
 	process_launch(p);
 	return p->pid;
 }
@@ -289,10 +273,50 @@ int sys_process_stats(struct process_stats *s, int pid)
 	return process_stats(pid, s);
 }
 
+/*
+A process may only change the priority of itself, its threads and
+its children.  Any other process, kernel threads included, is left
+to the nice command of the kernel shell.
+*/
+
+int sys_process_set_priority(int pid, int priority)
+{
+	struct process *p = process_lookup(pid);
+	if(!p) return KERROR_NOT_FOUND;
+	if(p->leader != current->leader && p->parent != current) return KERROR_PERMISSION_DENIED;
+	return process_set_priority(pid, priority);
+}
+
+int sys_process_list(int *pids, int max)
+{
+	if(max < 0 || !is_valid_pointer(pids, max * sizeof(int))) return KERROR_INVALID_ADDRESS;
+	return process_list_pids(pids, max);
+}
+
 int sys_process_heap(int delta)
 {
-	process_data_size_set(current, current->vm_data_size + delta);
-	return PROCESS_ENTRY_POINT + current->vm_data_size;
+	struct process *leader = current->leader;
+	process_data_size_set(leader, leader->vm_data_size + delta);
+	return PROCESS_ENTRY_POINT + leader->vm_data_size;
+}
+
+/*
+A new thread starts at entry, on a user stack that the caller
+has already allocated and filled in with the arguments of entry.
+*/
+
+int sys_thread_create(uint32_t entry, uint32_t stack)
+{
+	if(entry < PROCESS_ENTRY_POINT || stack < PROCESS_ENTRY_POINT) return KERROR_INVALID_ADDRESS;
+	struct process *p = process_create_thread(entry, stack);
+	process_launch(p);
+	return p->pid;
+}
+
+int sys_thread_join(int tid, struct process_info *info)
+{
+	if(!is_valid_pointer(info,sizeof(*info))) return KERROR_INVALID_ADDRESS;
+	return process_thread_join(tid, info);
 }
 
 int sys_object_list( int fd, char *buffer, int length)
@@ -510,6 +534,8 @@ int sys_system_stats(struct system_stats *s)
 		s->blocks_read[i] = a.blocks_read[i];
 	}
 
+	process_sched_stats(s);
+
 	return 0;
 }
 
@@ -526,6 +552,19 @@ int sys_bcache_flush()
 	return 0;
 }
 
+/* Sets the most blocks the buffer cache may hold, and returns the limit actually set. */
+int sys_bcache_set_size(int blocks)
+{
+	return bcache_set_size(blocks);
+}
+
+int sys_kmalloc_stats(struct kmalloc_stats *s)
+{
+	if(!is_valid_pointer(s,sizeof(*s))) return KERROR_INVALID_ADDRESS;
+	kmalloc_stats(s);
+	return 0;
+}
+
 int sys_system_time( uint32_t *tm )
 {
 	if(!is_valid_pointer(tm,sizeof(*tm))) return KERROR_INVALID_ADDRESS;
@@ -542,6 +581,14 @@ int sys_system_rtc( struct rtc_time *t )
 	return 0;
 }
 
+int sys_system_clock( uint32_t *ms )
+{
+	if(!is_valid_pointer(ms,sizeof(*ms))) return KERROR_INVALID_ADDRESS;
+	clock_t t = clock_read();
+	*ms = t.seconds * 1000 + t.millis;
+	return 0;
+}
+
 int sys_device_driver_stats(const char * name, struct device_driver_stats * stats)
 {
 	if(!is_valid_string(name)) return KERROR_INVALID_ADDRESS;
@@ -585,8 +632,16 @@ int32_t syscall_handler(syscall_t n, uint32_t a, uint32_t b, uint32_t c, uint32_
 		return sys_process_sleep(a);
 	case SYSCALL_PROCESS_STATS:
 		return sys_process_stats((struct process_stats *) a, b);
+	case SYSCALL_PROCESS_SET_PRIORITY:
+		return sys_process_set_priority(a, b);
+	case SYSCALL_PROCESS_LIST:
+		return sys_process_list((int *) a, b);
 	case SYSCALL_PROCESS_HEAP:
 		return sys_process_heap(a);
+	case SYSCALL_THREAD_CREATE:
+		return sys_thread_create(a, b);
+	case SYSCALL_THREAD_JOIN:
+		return sys_thread_join(a, (struct process_info *) b);
 	case SYSCALL_OPEN_FILE:
 		return sys_open_file(a, (const char *)b, c, d);
 	case SYSCALL_OPEN_DIR:
@@ -627,10 +682,16 @@ int32_t syscall_handler(syscall_t n, uint32_t a, uint32_t b, uint32_t c, uint32_
 		return sys_bcache_stats((struct bcache_stats *) a);
 	case SYSCALL_BCACHE_FLUSH:
 		return sys_bcache_flush();
+	case SYSCALL_BCACHE_SET_SIZE:
+		return sys_bcache_set_size(a);
+	case SYSCALL_KMALLOC_STATS:
+		return sys_kmalloc_stats((struct kmalloc_stats *) a);
 	case SYSCALL_SYSTEM_TIME:
 		return sys_system_time((uint32_t*)a);
 	case SYSCALL_SYSTEM_RTC:
 		return sys_system_rtc((struct rtc_time *) a);
+	case SYSCALL_SYSTEM_CLOCK:
+		return sys_system_clock((uint32_t *) a);
 	case SYSCALL_DEVICE_DRIVER_STATS:
 		return sys_device_driver_stats((char *) a, (struct device_driver_stats *) b);
 	default:
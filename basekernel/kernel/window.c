@@ -1,7 +1,7 @@
 
 #include "window.h"
 #include "graphics.h"
-#include "kmalloc.h"
+#include "slab.h"
 #include "string.h"
 
 struct window {
@@ -13,6 +13,8 @@ struct window {
 
 struct window window_root = {0};
 
+static struct kmem_cache window_cache = KMEM_CACHE_INIT("window", sizeof(struct window));
+
 struct window * window_create_root()
 {
 	struct window *w = &window_root;
@@ -25,7 +27,7 @@ struct window * window_create_root()
 
 struct window * window_create( struct window *parent, int x, int y, int width, int height )
 {
-	struct window *w = kmalloc(sizeof(*w));
+	struct window *w = kmem_cache_alloc(&window_cache);
 	w->parent = parent;
 	w->graphics = graphics_create(parent->graphics);
 	graphics_clip(w->graphics,x,y,width,height);
@@ -52,7 +54,7 @@ void window_delete( struct window *w )
 		graphics_delete(w->graphics);
 		event_queue_delete(w->queue);
 		window_delete(w->parent);
-		kfree(w);
+		kmem_cache_free(&window_cache, w);
 	}
 }
 
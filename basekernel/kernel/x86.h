@@ -16,6 +16,7 @@ See the file LICENSE for details.
 #define X86_SEGMENT_USER_CODE    X86_SEGMENT_SELECTOR(3,3)
 #define X86_SEGMENT_USER_DATA    X86_SEGMENT_SELECTOR(4,3)
 #define X86_SEGMENT_TSS          X86_SEGMENT_SELECTOR(5,0)
+#define X86_SEGMENT_PERCPU       X86_SEGMENT_SELECTOR(6,0)
 
 struct x86_eflags {
 	unsigned carry:1;
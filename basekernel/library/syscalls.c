@@ -78,11 +78,47 @@ int syscall_process_stats(struct process_stats *s, unsigned int pid)
 	return syscall(SYSCALL_PROCESS_STATS, (uint32_t) s, pid, 0, 0, 0);
 }
 
+int syscall_process_set_priority(unsigned int pid, int priority)
+{
+	return syscall(SYSCALL_PROCESS_SET_PRIORITY, pid, priority, 0, 0, 0);
+}
+
+int syscall_process_list(int *pids, int max)
+{
+	return syscall(SYSCALL_PROCESS_LIST, (uint32_t) pids, max, 0, 0, 0);
+}
+
 extern void *syscall_process_heap(int a)
 {
 	return (void *) syscall(SYSCALL_PROCESS_HEAP, a, 0, 0, 0, 0);
 }
 
+/*
+A new thread starts in thread_start, which finds entry and arg
+on the stack that syscall_thread_create laid out for it, and ends
+the thread when entry returns.
+*/
+
+static void thread_start(void (*entry) (void *), void *arg)
+{
+	entry(arg);
+	syscall_process_exit(0);
+}
+
+int syscall_thread_create(void (*entry) (void *), void *arg, void *stack, int stack_size)
+{
+	uint32_t *sp = (uint32_t *) (((uint32_t) stack + stack_size) & ~15);
+	*--sp = (uint32_t) arg;
+	*--sp = (uint32_t) entry;
+	*--sp = 0;	// return address of thread_start, never used
+	return syscall(SYSCALL_THREAD_CREATE, (uint32_t) thread_start, (uint32_t) sp, 0, 0, 0);
+}
+
+int syscall_thread_join(unsigned int tid, struct process_info *info)
+{
+	return syscall(SYSCALL_THREAD_JOIN, tid, (uint32_t) info, 0, 0, 0);
+}
+
 int syscall_open_file( int fd, const char *path, int mode, kernel_flags_t flags)
 {
 	return syscall(SYSCALL_OPEN_FILE, fd, (uint32_t) path, mode, flags, 0);
@@ -183,6 +219,16 @@ int syscall_bcache_flush()
 	return syscall(SYSCALL_BCACHE_FLUSH, 0, 0, 0, 0, 0);
 }
 
+int syscall_bcache_set_size(int blocks)
+{
+	return syscall(SYSCALL_BCACHE_SET_SIZE, blocks, 0, 0, 0, 0);
+}
+
+int syscall_kmalloc_stats(struct kmalloc_stats *s)
+{
+	return syscall(SYSCALL_KMALLOC_STATS, (uint32_t) s, 0, 0, 0, 0);
+}
+
 int syscall_system_time( uint32_t *t )
 {
 	return syscall(SYSCALL_SYSTEM_TIME, (uint32_t)t, 0, 0, 0, 0);
@@ -193,6 +239,11 @@ int syscall_system_rtc( struct rtc_time *time )
 	return syscall(SYSCALL_SYSTEM_RTC, (uint32_t)time, 0, 0, 0, 0);
 }
 
+int syscall_system_clock( uint32_t *ms )
+{
+	return syscall(SYSCALL_SYSTEM_CLOCK, (uint32_t)ms, 0, 0, 0, 0);
+}
+
 int syscall_device_driver_stats(char * name, void * stats)
 {
 	return syscall(SYSCALL_DEVICE_DRIVER_STATS, (uint32_t) name, (uint32_t) stats, 0, 0, 0);
@@ -17,7 +17,8 @@ typedef enum STAT_LIVE {
   DRIVER_LIVE,
   BCACHE_LIVE,
   SYSTEM_LIVE,
-  PROCESS_LIVE
+  PROCESS_LIVE,
+  TOP_LIVE
 } STAT_LIVE;
 
 struct stat_args {
@@ -41,6 +42,7 @@ void create_graph(STAT_LIVE stat_type, char * stat_name, char * stat_arg, int wi
 int  extract_statistic(struct stat_args * args);
 void plot_bars(int * most_recent_vals, int max, int window_width, int window_height, int plot_width, int plot_height, int thickness, int char_offset);
 void run_stats(struct stat_args * args);
+void run_top();
 
 struct nwindow *nw = 0;
 
@@ -77,6 +79,9 @@ int main(int argc, const char * argv[]) {
       args.pid_s = strdup(argv[++current_arg]);
       str2int(args.pid_s, &(args.pid));
     }
+    else if (!strcmp(argv[current_arg], "-top")) {
+      args.stat_type = TOP_LIVE;
+    }
     else if (!strcmp(argv[current_arg], "-s")) {
       args.stat_name = strdup(argv[++current_arg]);
     }
@@ -92,12 +97,17 @@ int main(int argc, const char * argv[]) {
     ++current_arg;
   }
 
-  if (!args.stat_name) {
+  if (!args.stat_name && args.stat_type != TOP_LIVE) {
     help(); return 1;
   }
 
   nw = nw_create_default();
 
+  if (args.stat_type == TOP_LIVE) {
+    run_top();
+    return 0;
+  }
+
   /* Start tracking stats */
   run_stats(&args);
 
@@ -186,6 +196,137 @@ void run_stats(struct stat_args * args)
   nw_flush(nw);
 }
 
+/*
+ * The top view lists the busiest processes first, with the ticks
+ * they used in user and system mode since the last refresh, and their
+ * totals of context switches, faults and resident pages.  Every
+ * process is sampled and sorted, and only then cut to the rows of
+ * the window, so that a busy process shows whenever it was created.
+ */
+
+#define TOP_ROWS 24
+#define TOP_COLUMNS 9
+#define TOP_COLUMN_WIDTH 56
+#define TOP_LINE_HEIGHT 12
+#define TOP_INTERVAL 2000
+
+struct top_entry {
+  int pid;
+  int user_delta;
+  int system_delta;
+  struct process_stats stats;
+};
+
+static const char * top_headings[TOP_COLUMNS] = { "PID", "USER", "SYS", "VCSW", "ICSW", "MINFLT", "MAJFLT", "RSS", "PEAK" };
+
+struct top_ticks {
+  int pid;
+  int user_ticks;
+  int system_ticks;
+};
+
+static int * top_pids = 0;
+static struct top_entry * top_entries = 0;
+static struct top_entry ** top_order = 0;
+static struct top_ticks * top_previous = 0;
+static int top_previous_count = 0;
+static int top_capacity = 0;
+
+/* Make room to sample count processes, or return false if out of memory */
+int top_reserve(int count) {
+  if (count <= top_capacity) return 1;
+  count += 16;
+
+  int * pids = realloc(top_pids, count * sizeof(*pids));
+  if (pids) top_pids = pids;
+  struct top_entry * entries = realloc(top_entries, count * sizeof(*entries));
+  if (entries) top_entries = entries;
+  struct top_entry ** order = realloc(top_order, count * sizeof(*order));
+  if (order) top_order = order;
+  struct top_ticks * previous = realloc(top_previous, count * sizeof(*previous));
+  if (previous) top_previous = previous;
+
+  if (!pids || !entries || !order || !previous) return 0;
+  top_capacity = count;
+  return 1;
+}
+
+/* Fill in the stats of each process and its ticks since the last sample, busiest first */
+int top_sample() {
+  int i, j, n = 0;
+
+  /* The list returns how many processes there are, so grow until all fit */
+  int count = syscall_process_list(top_pids, top_capacity);
+  while (count > top_capacity && top_reserve(count))
+    count = syscall_process_list(top_pids, top_capacity);
+  if (count > top_capacity) count = top_capacity;
+
+  for (i = 0; i < count; i++) {
+    struct top_entry * e = &top_entries[n];
+    if (syscall_process_stats(&e->stats, top_pids[i])) continue;
+    e->pid = top_pids[i];
+    e->user_delta = e->stats.user_ticks;
+    e->system_delta = e->stats.system_ticks;
+    for (j = 0; j < top_previous_count; j++) {
+      if (top_previous[j].pid == e->pid) {
+        e->user_delta -= top_previous[j].user_ticks;
+        e->system_delta -= top_previous[j].system_ticks;
+        break;
+      }
+    }
+    top_order[n++] = e;
+  }
+
+  /* Insertion sort of pointers: only as many as there are processes */
+  for (i = 1; i < n; i++) {
+    struct top_entry * e = top_order[i];
+    for (j = i; j > 0 && top_order[j-1]->user_delta + top_order[j-1]->system_delta < e->user_delta + e->system_delta; j--)
+      top_order[j] = top_order[j-1];
+    top_order[j] = e;
+  }
+
+  /* Remember the ticks of every process, not only the ones shown */
+  for (i = 0; i < n; i++) {
+    top_previous[i].pid = top_entries[i].pid;
+    top_previous[i].user_ticks = top_entries[i].stats.user_ticks;
+    top_previous[i].system_ticks = top_entries[i].stats.system_ticks;
+  }
+  top_previous_count = n;
+
+  return n;
+}
+
+void top_draw(int count) {
+  int i, j;
+  char str[16];
+
+  nw_clear(nw, 0, 0, TOP_COLUMNS * TOP_COLUMN_WIDTH + 16, (TOP_ROWS + 2) * TOP_LINE_HEIGHT);
+  for (j = 0; j < TOP_COLUMNS; j++)
+    nw_string(nw, 8 + j * TOP_COLUMN_WIDTH, 4, top_headings[j]);
+
+  for (i = 0; i < count && i < TOP_ROWS; i++) {
+    struct top_entry * e = top_order[i];
+    int values[TOP_COLUMNS] = { e->pid, e->user_delta, e->system_delta,
+      e->stats.voluntary_switches, e->stats.involuntary_switches,
+      e->stats.minor_faults, e->stats.major_faults,
+      e->stats.resident_pages, e->stats.peak_resident_pages };
+    for (j = 0; j < TOP_COLUMNS; j++) {
+      uint_to_string((uint32_t) values[j], str);
+      nw_string(nw, 8 + j * TOP_COLUMN_WIDTH, 4 + (i + 1) * TOP_LINE_HEIGHT, str);
+    }
+  }
+  nw_flush(nw);
+}
+
+void run_top() {
+  if (!top_reserve(TOP_ROWS)) return;
+
+  while (nw_getchar(nw, 0) != 'q') {
+    top_draw(top_sample());
+    syscall_process_sleep(TOP_INTERVAL);
+  }
+}
+
 /* Return one stat from statistics structure */
 int extract_statistic(struct stat_args * args) {
 
@@ -200,6 +341,14 @@ int extract_statistic(struct stat_args * args) {
       return ((struct bcache_stats *)args->statistics)->write_misses;
     } else if (!strcmp(args->stat_name, "writebacks")) {
       return ((struct bcache_stats *)args->statistics)->writebacks;
+    } else if (!strcmp(args->stat_name, "evictions")) {
+      return ((struct bcache_stats *)args->statistics)->evictions;
+    } else if (!strcmp(args->stat_name, "readahead_hits")) {
+      return ((struct bcache_stats *)args->statistics)->readahead_hits;
+    } else if (!strcmp(args->stat_name, "readahead_misses")) {
+      return ((struct bcache_stats *)args->statistics)->readahead_misses;
+    } else if (!strcmp(args->stat_name, "size")) {
+      return ((struct bcache_stats *)args->statistics)->size;
     }
   }
   else if (args->stat_type == PROCESS_LIVE) {
@@ -213,6 +362,20 @@ int extract_statistic(struct stat_args * args) {
       return ((struct process_stats *)args->statistics)->bytes_written;
     } else if (!strcmp(args->stat_name, "syscall_count")) {
       return ((struct process_stats *)args->statistics)->syscall_count[args->syscall_index];
+    } else if (!strcmp(args->stat_name, "user_ticks")) {
+      return ((struct process_stats *)args->statistics)->user_ticks;
+    } else if (!strcmp(args->stat_name, "system_ticks")) {
+      return ((struct process_stats *)args->statistics)->system_ticks;
+    } else if (!strcmp(args->stat_name, "voluntary_switches")) {
+      return ((struct process_stats *)args->statistics)->voluntary_switches;
+    } else if (!strcmp(args->stat_name, "involuntary_switches")) {
+      return ((struct process_stats *)args->statistics)->involuntary_switches;
+    } else if (!strcmp(args->stat_name, "minor_faults")) {
+      return ((struct process_stats *)args->statistics)->minor_faults;
+    } else if (!strcmp(args->stat_name, "major_faults")) {
+      return ((struct process_stats *)args->statistics)->major_faults;
+    } else if (!strcmp(args->stat_name, "resident_pages")) {
+      return ((struct process_stats *)args->statistics)->resident_pages;
     }
   }
   else if (args->stat_type == DRIVER_LIVE) {
@@ -351,6 +514,7 @@ void help() {
   printf("                -dr  <DRIVER_NAME>   # driver stats\n");
   printf("                -sys <BLOCK>         # system stats\n");
   printf("                -p   <PID>           # process stats\n");
+  printf("                -top                 # all processes, busiest first\n");
   printf("                -sc  <SYSCALL>       # syscall number\n");
   printf("                -s   <STAT_NAME>     # name of statistic\n");
 
@@ -359,13 +523,24 @@ void help() {
   printf("    read_misses\n");
   printf("    write_hits\n");
   printf("    write_misses\n");
-  printf("    writebacks\n\n");
+  printf("    writebacks\n");
+  printf("    evictions\n");
+  printf("    readahead_hits\n");
+  printf("    readahead_misses\n");
+  printf("    size\n\n");
 
   printf("\nProcess STAT_NAME options:\n");
   printf("    blocks_read\n");
   printf("    blocks_written\n");
   printf("    bytes_read\n");
   printf("    bytes_written\n");
+  printf("    user_ticks\n");
+  printf("    system_ticks\n");
+  printf("    voluntary_switches\n");
+  printf("    involuntary_switches\n");
+  printf("    minor_faults\n");
+  printf("    major_faults\n");
+  printf("    resident_pages\n");
   printf("    syscall_count\n\n");
 
   printf("\nDriver STAT_NAME options:\n");
@@ -22,6 +22,19 @@ int main(int argc, char *argv[])
 	printf("Disk 1: %d blocks read, %d blocks written\n", s.blocks_read[1], s.blocks_written[1]);
 	printf("Disk 2: %d blocks read, %d blocks written\n", s.blocks_read[2], s.blocks_written[2]);
 	printf("Disk 3: %d blocks read, %d blocks written\n", s.blocks_read[3], s.blocks_written[3]);
+	printf("Scheduler: %d tick quantum at %d ticks/s, %d switches, %d preemptions\n", s.sched_quantum, s.sched_ticks_per_second, s.sched_switches, s.sched_preemptions);
+
+	printf("Wakeup latency:\n");
+	for(int i = 0; i < SCHED_LATENCY_BUCKETS; i++) {
+		if(s.sched_latency[i] == 0) continue;
+		if(i == 0) {
+			printf("  under 32 us: %d\n", s.sched_latency[i]);
+		} else if(i == SCHED_LATENCY_BUCKETS - 1) {
+			printf("  %d us and up: %d\n", 16 << i, s.sched_latency[i]);
+		} else {
+			printf("  %d-%d us: %d\n", 16 << i, 32 << i, s.sched_latency[i]);
+		}
+	}
 
 
 	return 0;
@@ -0,0 +1,71 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+/*
+Measures the cost of fork for a process with a non-trivial heap.
+Each child touches a few pages and exits at once, as a shell does
+before exec, and the parent reports the average fork latency and
+the number of pages copied on behalf of parent and children.
+Run it with no arguments, or give the number of forks and the
+number of heap pages.
+*/
+
+#include "library/syscalls.h"
+#include "library/string.h"
+
+#define PAGE_SIZE 4096
+
+int main(int argc, const char *argv[])
+{
+	int nforks = 100;
+	int npages = 64;
+	int touched = 4;
+	int i, j;
+
+	if(argc > 1) str2int(argv[1], &nforks);
+	if(argc > 2) str2int(argv[2], &npages);
+	if(touched > npages) touched = npages;
+
+	char *heap = (char *) syscall_process_heap(npages * PAGE_SIZE) - npages * PAGE_SIZE;
+	for(i = 0; i < npages; i++) {
+		heap[i * PAGE_SIZE] = i;
+	}
+
+	struct process_stats before, after, child;
+	struct process_info info;
+	uint32_t start, stop;
+	int children_copied = 0;
+
+	syscall_process_stats(&before, syscall_process_self());
+	syscall_system_clock(&start);
+
+	for(i = 0; i < nforks; i++) {
+		int pid = syscall_process_fork();
+		if(pid == 0) {
+			for(j = 0; j < touched; j++) {
+				heap[j * PAGE_SIZE]++;
+			}
+			syscall_process_exit(0);
+		} else if(pid < 0) {
+			printf("forkbench: fork failed: %d\n", pid);
+			return 1;
+		}
+		syscall_process_wait(&info, -1);
+		if(!syscall_process_stats(&child, info.pid)) {
+			children_copied += child.pages_copied;
+		}
+		syscall_process_reap(info.pid);
+	}
+
+	syscall_system_clock(&stop);
+	syscall_process_stats(&after, syscall_process_self());
+
+	printf("forkbench: %d forks of a %d page heap in %d ms\n", nforks, npages, stop - start);
+	printf("forkbench: %d us per fork\n", (stop - start) * 1000 / nforks);
+	printf("forkbench: %d pages copied by parent, %d by children\n", after.pages_copied - before.pages_copied, children_copied);
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+/*
+Measures the throughput of memcpy and memset in the user library
+for a range of buffer sizes, from a small structure to a large
+block of file data.  Run it with no arguments, or give the total
+number of megabytes to move at each size.  Before timing, it checks
+the results of both over unaligned offsets and odd lengths, so that
+every path through them is exercised: the byte head and tail, the
+word loop, and the SSE2 blocks.
+*/
+
+#include "library/syscalls.h"
+#include "library/string.h"
+
+#define MEMBENCH_MAX 65536
+
+static char src[MEMBENCH_MAX + 16];
+static char dst[MEMBENCH_MAX + 16];
+
+static int sizes[] = { 64, 512, 4096, 65536 };
+
+static int check_lengths[] = { 0, 1, 2, 3, 4, 5, 7, 8, 15, 63, 64, 65, 255, 256, 257, 319, 1000, 4099 };
+
+#define CHECK_GUARD 16
+#define CHECK_FILL 0x5a
+
+/* Returns the number of copies and fills that did not come out right. */
+
+static int check()
+{
+	int i, n, soff, doff, failures = 0;
+
+	for(n = 0; n < sizeof(check_lengths) / sizeof(check_lengths[0]); n++) {
+		int length = check_lengths[n];
+		for(soff = 0; soff < 4; soff++) {
+			for(doff = 0; doff < 16; doff++) {
+				char *d = dst + doff;
+				char *s = src + soff;
+				int bad = 0;
+
+				for(i = 0; i < length + 2 * CHECK_GUARD; i++) d[i] = CHECK_FILL;
+				memcpy(d + CHECK_GUARD, s, length);
+				for(i = 0; i < length + 2 * CHECK_GUARD; i++) {
+					char want = (i >= CHECK_GUARD && i < CHECK_GUARD + length) ? s[i - CHECK_GUARD] : CHECK_FILL;
+					if(d[i] != want) bad = 1;
+				}
+				if(bad) {
+					printf("membench: memcpy of %d bytes from +%d to +%d is wrong\n", length, soff, doff);
+					failures++;
+				}
+			}
+		}
+
+		for(doff = 0; doff < 16; doff++) {
+			char *d = dst + doff;
+			char value = (char) (0xa5 + doff);
+			int bad = 0;
+
+			for(i = 0; i < length + 2 * CHECK_GUARD; i++) d[i] = CHECK_FILL;
+			memset(d + CHECK_GUARD, value, length);
+			for(i = 0; i < length + 2 * CHECK_GUARD; i++) {
+				char want = (i >= CHECK_GUARD && i < CHECK_GUARD + length) ? value : CHECK_FILL;
+				if(d[i] != want) bad = 1;
+			}
+			if(bad) {
+				printf("membench: memset of %d bytes at +%d is wrong\n", length, doff);
+				failures++;
+			}
+		}
+	}
+
+	return failures;
+}
+
+static void report(const char *name, int size, int megabytes, uint32_t ms)
+{
+	if(ms == 0)
+		ms = 1;
+	printf("membench: %s %d bytes: %d MB/s\n", name, size, megabytes * 1000 / ms);
+}
+
+int main(int argc, const char *argv[])
+{
+	int megabytes = 64;
+	int i, j, count;
+	uint32_t start, stop;
+
+	if(argc > 1) str2int(argv[1], &megabytes);
+
+	// Not periodic in 256, so that a copy from the wrong offset shows.
+	for(i = 0; i < MEMBENCH_MAX + 16; i++) {
+		src[i] = i * 7 + i / 251;
+	}
+
+	int failures = check();
+	if(failures) {
+		printf("membench: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("membench: memcpy and memset checked\n");
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int size = sizes[i];
+		count = megabytes * 1024 * 1024 / size;
+
+		syscall_system_clock(&start);
+		for(j = 0; j < count; j++) {
+			memcpy(dst, src, size);
+		}
+		syscall_system_clock(&stop);
+		report("memcpy", size, megabytes, stop - start);
+
+		// The same copy with the destination off by one byte.
+		syscall_system_clock(&start);
+		for(j = 0; j < count; j++) {
+			memcpy(dst + 1, src, size);
+		}
+		syscall_system_clock(&stop);
+		report("memcpy unaligned", size, megabytes, stop - start);
+
+		syscall_system_clock(&start);
+		for(j = 0; j < count; j++) {
+			memset(dst, j, size);
+		}
+		syscall_system_clock(&stop);
+		report("memset", size, megabytes, stop - start);
+	}
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+/*
+Measures how many processes can be spawned per second.
+The benchmark runs itself over and over with the argument
+"child", which exits at once, and waits for each child before
+starting the next, first with process_run, which gives the child
+all the objects of the parent, then with process_wrun, which
+gives it only the three standard ones.  Run it by its path,
+with the number of spawns as an optional argument.
+*/
+
+#include "library/syscalls.h"
+#include "library/string.h"
+#include "library/errno.h"
+
+static int spawn_loop(int fd, const char *path, int nspawns, int remap)
+{
+	const char *args[] = { path, "child" };
+	int fds[] = { 0, 1, 2 };
+	struct process_info info;
+	int i, pid;
+
+	for(i = 0; i < nspawns; i++) {
+		if(remap) {
+			pid = syscall_process_wrun(fd, 2, args, fds, 3);
+		} else {
+			pid = syscall_process_run(fd, 2, args);
+		}
+		if(pid < 0) {
+			printf("spawnbench: couldn't run %s: %s\n", path, strerror(pid));
+			return -1;
+		}
+		syscall_process_wait(&info, -1);
+		syscall_process_reap(info.pid);
+	}
+	return 0;
+}
+
+static void report(const char *name, int nspawns, uint32_t millis)
+{
+	if(millis == 0)
+		millis = 1;
+	printf("spawnbench: %s: %d spawns in %d ms, %d per second, %d us each\n", name, nspawns, millis, nspawns * 1000 / millis, millis * 1000 / nspawns);
+}
+
+int main(int argc, const char *argv[])
+{
+	int nspawns = 100;
+	uint32_t start, stop;
+
+	if(argc > 1 && !strcmp(argv[1], "child")) {
+		return 0;
+	}
+	if(argc > 1) str2int(argv[1], &nspawns);
+	if(nspawns < 1) nspawns = 1;
+
+	int fd = syscall_open_file(KNO_STDDIR, argv[0], 0, 0);
+	if(fd < 0) {
+		printf("spawnbench: couldn't open %s: %s\n", argv[0], strerror(fd));
+		return 1;
+	}
+
+	syscall_system_clock(&start);
+	if(spawn_loop(fd, argv[0], nspawns, 0) < 0) return 1;
+	syscall_system_clock(&stop);
+	report("run", nspawns, stop - start);
+
+	syscall_system_clock(&start);
+	if(spawn_loop(fd, argv[0], nspawns, 1) < 0) return 1;
+	syscall_system_clock(&stop);
+	report("wrun", nspawns, stop - start);
+
+	syscall_object_close(fd);
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+Copyright (C) 2016-2019 The University of Notre Dame
+This software is distributed under the GNU General Public License.
+See the file LICENSE for details.
+*/
+
+/*
+Starts several threads that each add up a slice of a shared array,
+then joins them and checks the total.  The threads share the heap
+of the process, so the array and the results are not copied.
+*/
+
+#include "library/syscalls.h"
+#include "library/string.h"
+
+#define NTHREADS 4
+#define COUNT 100000
+#define STACK_SIZE 4096
+
+static int numbers[COUNT];
+static int sums[NTHREADS];
+
+static void worker(void *arg)
+{
+	int n = (int) arg;
+	int i, sum = 0;
+	for(i = n * COUNT / NTHREADS; i < (n + 1) * COUNT / NTHREADS; i++) {
+		sum += numbers[i];
+	}
+	sums[n] = sum;
+}
+
+int main(int argc, const char *argv[])
+{
+	static char stacks[NTHREADS][STACK_SIZE];
+	int tids[NTHREADS];
+	struct process_info info;
+	int i, total = 0, expected = 0;
+
+	for(i = 0; i < COUNT; i++) {
+		numbers[i] = i % 7;
+		expected += i % 7;
+	}
+
+	for(i = 0; i < NTHREADS; i++) {
+		tids[i] = syscall_thread_create(worker, (void *) i, stacks[i], STACK_SIZE);
+		if(tids[i] < 0) {
+			printf("threadtest: couldn't create thread: %d\n", tids[i]);
+			return 1;
+		}
+	}
+
+	for(i = 0; i < NTHREADS; i++) {
+		syscall_thread_join(tids[i], &info);
+		total += sums[i];
+	}
+
+	printf("threadtest: %d threads added up %d, expected %d\n", NTHREADS, total, expected);
+	return total != expected;
+}